@@ -0,0 +1,124 @@
+#include <stdlib.h>
+
+#include "arena.h"
+
+/* Slabs and big blocks start with a link so they can be found again. */
+typedef struct BLOCK BLOCK;
+struct BLOCK{
+    BLOCK *prev, *next;
+    size_t n;
+    void *pad[];
+};
+
+static size_t
+classsize(int k)
+{
+    return (size_t)(k % 2? 24 : 16) << (k / 2);
+}
+
+static int
+classof(size_t n)
+{
+    int k = 0;
+    while (classsize(k) < n)
+        k++;
+    return k;
+}
+
+static void *
+bigalloc(ARENA *a, size_t n)
+{
+    BLOCK *b = malloc(sizeof(BLOCK) + n);
+    if (!b)
+        return NULL;
+    b->prev = NULL;
+    b->next = a->big;
+    b->n = n;
+    if (b->next)
+        b->next->prev = b;
+    a->big = b;
+    a->held += n;
+    a->used += n;
+    return b->pad;
+}
+
+static void
+bigfree(ARENA *a, void *p)
+{
+    BLOCK *b = (BLOCK *)((char *)p - offsetof(BLOCK, pad));
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        a->big = b->next;
+    if (b->next)
+        b->next->prev = b->prev;
+    a->held -= b->n;
+    a->used -= b->n;
+    free(b);
+}
+
+/* Allocate at least n bytes, setting *got to how many were given. */
+void *
+arenaalloc(ARENA *a, size_t n, size_t *got)
+{
+    if (n > ARENA_BIG){
+        *got = n;
+        return bigalloc(a, n);
+    }
+
+    int k = classof(n);
+    size_t m = classsize(k);
+    void *p = a->free[k];
+    if (p)
+        a->free[k] = *(void **)p;
+    else{
+        if ((size_t)(a->end - a->next) < m){
+            BLOCK *s = malloc(sizeof(BLOCK) + ARENA_SLAB);
+            if (!s)
+                return NULL;
+            s->next = a->slabs;
+            a->slabs = s;
+            a->next = (char *)s->pad;
+            a->end = a->next + ARENA_SLAB;
+            a->held += ARENA_SLAB;
+        }
+        p = a->next;
+        a->next += m;
+    }
+    a->used += m;
+    *got = m;
+    return p;
+}
+
+/* Give back p, which arenaalloc said was n bytes. */
+void
+arenafree(ARENA *a, void *p, size_t n)
+{
+    if (!p)
+        return;
+    if (n > ARENA_BIG){
+        bigfree(a, p);
+        return;
+    }
+
+    int k = classof(n);
+    *(void **)p = a->free[k];
+    a->free[k] = p;
+    a->used -= classsize(k);
+}
+
+void
+arenarelease(ARENA *a)
+{
+    while (a->slabs){
+        BLOCK *s = a->slabs;
+        a->slabs = s->next;
+        free(s);
+    }
+    while (a->big){
+        BLOCK *b = a->big;
+        a->big = b->next;
+        free(b);
+    }
+    *a = (ARENA){0};
+}
@@ -0,0 +1,27 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#include "structs.h"
+
+/* Blocks are handed out in size classes running 16, 24, 32, 48, ...
+ * up to ARENA_BIG bytes, carved from slabs by bumping a pointer and
+ * recycled through a free list per class. Anything larger is allocated
+ * on its own. Releasing the arena releases everything at once.
+ */
+#define ARENA_SLAB    65536
+#define ARENA_BIG     4096
+#define ARENA_CLASSES 17
+struct ARENA{
+    void *slabs, *big;
+    char *next, *end;
+    void *free[ARENA_CLASSES];
+    size_t held, used;
+};
+
+void *arenaalloc(ARENA *a, size_t n, size_t *got);
+void arenafree(ARENA *a, void *p, size_t n);
+void arenarelease(ARENA *a);
+
+#endif
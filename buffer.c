@@ -1,225 +1,2352 @@
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "structs.h"
+#include "arena.h"
 #include "buffer.h"
-
-#define SLACK 255
+#include "util.h"
 
 typedef enum{MA, PO, IL, DL, IT, DT} action;
 struct JOURNAL{
     JOURNAL *prev;
     action a;
     POS p;
+    size_t n; /* lines for IL and DL */
+    LINE *l;  /* the lines removed by DL */
+    LINE t;   /* the text inserted by IT or removed by DT */
+};
+
+/* Line text is kept at the narrowest of one, two or four bytes per
+ * character that holds every character in the line. Text that fits in
+ * the LINE itself is kept there; longer text gets storage of its own
+ * that grows by half again when it fills. Lines from a mapped file are
+ * left undecoded until they are used, and if they turn out to be plain
+ * ASCII they are then used where they lie. A line that is decoded but
+ * not changed remembers the bytes it came from, so that it can be put
+ * back to them if memory runs short; see pageout.
+ *
+ * A line being typed into keeps its spare room as a gap at the point of
+ * the last edit, so that typing or deleting there moves nothing; the
+ * gap is closed up when editing moves to another line.
+ *
+ * Lines longer than CHUNK_MIN characters are cut into chunks of at most
+ * CHUNK_MAX when they are changed, so that an edit only moves the text
+ * of one chunk however long the line is. A Fenwick tree over the chunks'
+ * lengths finds the chunk holding a column in O(log k) and is kept up
+ * to date as they grow and shrink; it is only rebuilt when chunks come
+ * or go, which happens once for every CHUNK_MAX / 4 or so characters.
+ */
+enum{
+    INLINE   = 1 << 0, /* text is in u.c */
+    BORROWED = 1 << 1, /* text is in someone else's storage */
+    ENCODED  = 1 << 2, /* n bytes yet to be decoded */
+    SHARED   = 1 << 3, /* text may also belong to a snapshot */
+    CHUNKED  = 1 << 4, /* text is in the chunks of the ROPE at u.h.p */
+    GAPPED   = 1 << 5, /* the u.h.a - n characters from g are a gap */
+    CACHED   = 1 << 6  /* decoded from the g bytes at u.h.a, unchanged */
+};
+
+#define CHUNK_MIN  (1 << 16)
+#define CHUNK_MAX  1024
+#define CHUNK_FILL (CHUNK_MAX * 3 / 4) /* how full new chunks are made */
+typedef struct{
+    size_t n;
+    unsigned char *p; /* room for CHUNK_MAX characters */
+} CHUNK;
+typedef struct{
+    size_t k, a; /* chunks used and allocated; only a sole chunk is empty */
+    CHUNK *c;
+    size_t *t;   /* the Fenwick tree, from t[1] to t[k] */
+} ROPE;
+
+/* The chunk of r holding column *c, which becomes a column in it. The
+ * end of the line is taken to be in the last chunk.
+ */
+static size_t
+ropefind(const ROPE *r, colno *c)
+{
+    size_t i = 0, m = 1;
+    while (m * 2 <= r->k)
+        m *= 2;
+    for (; m; m /= 2){
+        if (i + m <= r->k && r->t[i + m] <= *c){
+            i += m;
+            *c -= r->t[i];
+        }
+    }
+    if (i == r->k)
+        i--, *c += r->c[i].n;
+    return i;
+}
+
+static void
+ropeadd(ROPE *r, size_t i, size_t d)
+{
+    for (i++; i <= r->k; i += i & -i)
+        r->t[i] += d;
+}
+
+static void
+ropeindex(ROPE *r)
+{
+    for (size_t i = 1; i <= r->k; i++)
+        r->t[i] = r->c[i - 1].n;
+    for (size_t i = 1; i <= r->k; i++){
+        size_t j = i + (i & -i);
+        if (j <= r->k)
+            r->t[j] += r->t[i];
+    }
+}
+
+static unsigned char *
+text(const LINE *l)
+{
+    return l->f & INLINE? (unsigned char *)l->u.c : l->u.h.p;
+}
+
+static size_t
+room(const LINE *l)
+{
+    if (l->f & INLINE)
+        return TEXT_INLINE / l->w;
+    return l->f & (BORROWED | ENCODED | CHUNKED | GAPPED | CACHED)? 0 : l->u.h.a;
+}
+
+/* A borrowed view of as much of the n characters of l from column c as
+ * lie together.
+ */
+static LINE
+span(const LINE *l, colno c, size_t n)
+{
+    LINE v = {.n = n, .w = l->w, .f = BORROWED};
+    if (l->f & CHUNKED){
+        const ROPE *r = l->u.h.p;
+        const CHUNK *k = r->c + ropefind(r, &c);
+        if (v.n > k->n - c)
+            v.n = k->n - c;
+        v.u.h.p = k->p + c * l->w;
+    } else if (l->f & GAPPED && c >= l->g)
+        v.u.h.p = text(l) + (c + l->u.h.a - l->n) * l->w;
+    else{
+        if (l->f & GAPPED && v.n > l->g - c)
+            v.n = l->g - c;
+        v.u.h.p = text(l) + c * l->w;
+    }
+    return v;
+}
+
+static wint_t
+getch(const LINE *l, colno c)
+{
+    const unsigned char *s;
+    if (l->f & CHUNKED){
+        const ROPE *r = l->u.h.p;
+        s = r->c[ropefind(r, &c)].p;
+    } else if (l->f & GAPPED && c >= l->g){
+        s = text(l);
+        c += l->u.h.a - l->n;
+    } else
+        s = text(l);
+    switch (l->w){
+        case 1:  return s[c];
+        case 2:  return ((const uint16_t *)s)[c];
+        default: return ((const uint32_t *)s)[c];
+    }
+}
+
+static void
+putch(unsigned char *s, unsigned w, colno c, wint_t x)
+{
+    switch (w){
+        case 1:  s[c] = x;                 break;
+        case 2:  ((uint16_t *)s)[c] = x;   break;
+        default: ((uint32_t *)s)[c] = x;   break;
+    }
+}
+
+/* The narrowest width that holds n characters of l from column c. */
+static unsigned
+needs(const LINE *l, colno c, size_t n)
+{
+    unsigned w = 1;
+    for (size_t i = 0; l->w > 1 && i < n && w < l->w; ){
+        LINE v = span(l, c + i, n - i);
+        for (size_t j = 0; j < v.n && w < l->w; j++){
+            wint_t x = getch(&v, j);
+            if (x >= 0x10000)
+                w = 4;
+            else if (x >= 0x100)
+                w = 2;
+        }
+        i += v.n;
+    }
+    return w;
+}
+
+/* Copy n characters of s from column sc to column c of d, which is w wide. */
+static void
+copychars(unsigned char *d, unsigned w, colno c, const LINE *s, colno sc, size_t n)
+{
+    if (s->f & (CHUNKED | GAPPED)){
+        for (size_t i = 0; i < n; ){
+            LINE v = span(s, sc + i, n - i);
+            copychars(d, w, c + i, &v, 0, v.n);
+            i += v.n;
+        }
+    } else if (w == s->w)
+        memcpy(d + c * w, text(s) + sc * w, n * w);
+    else for (size_t i = 0; i < n; i++)
+        putch(d, w, c + i, getch(s, sc + i));
+}
+
+/* How many bytes the n characters of l from column c take encoded. */
+static size_t
+textbytes(const LINE *l, colno c, size_t n)
+{
+    size_t k = 0;
+    if (l->f & (CHUNKED | GAPPED)){
+        for (size_t i = 0; i < n; ){
+            LINE v = span(l, c + i, n - i);
+            k += textbytes(&v, 0, v.n);
+            i += v.n;
+        }
+        return k;
+    }
+
+    char s[MB_LEN_MAX];
+    mbstate_t ms;
+    memset(&ms, 0, sizeof(ms));
+    for (size_t i = 0; i < n; i++){
+        wint_t x = getch(l, c + i);
+        k += x < 0x80? 1 : encodechar(x, s, &ms);
+    }
+    return k;
+}
+
+/* How many bytes l takes encoded, less its newline, with how many
+ * characters in *chars. Lines that haven't been decoded are counted
+ * from their bytes.
+ */
+static size_t
+linesize(const LINE *l, size_t *chars)
+{
+    if (l->f & ENCODED)
+        return *chars = countchars(l->u.h.p, l->n), l->n;
+    *chars = l->n;
+    if (l->f & CACHED)
+        return l->g;
+    if (l->f & BORROWED && l->w == 1)
+        return l->n;
+    return textbytes(l, 0, l->n);
+}
+
+/* A snapshot freezes the buffer's lines for reading from another
+ * thread while editing goes on. Once one is taken, nodes are copied
+ * before they are changed and text is copied before it is changed in
+ * place, and whatever the snapshot still uses is retired to it rather
+ * than freed until it is dropped.
+ */
+struct SNAPSHOT{
+    BUFFER *b;
+    SNAPSHOT *of; /* the snapshot whose lines this reads, if it only reads */
+    NODE *root;
     size_t n;
-    wchar_t s[];
+    NODE **nodes; /* retired nodes */
+    size_t nnodes, anodes;
+    LINE *dead;   /* lines whose text is retired */
+    size_t ndead, adead;
+    NODE *leaf;   /* where the reader is */
+    lineno first;
+    LINE *l;      /* its lines, in unpacked if it is packed */
+    LINE *unpacked;
+    wchar_t *s;   /* the reader's scratch for decoding */
+    size_t sa;
+    LINE x;       /* the last line the reader decoded */
 };
 
-static bool
-merge(BUFFER *b, action a, POS p, const wchar_t *s, size_t n)
+/* Anything that can't be remembered for want of memory can only leak. */
+static void
+retire(void **a, size_t *n, size_t *na, const void *x, size_t w)
 {
-    if (b->j && b->j->a == IT && a == IT && b->j->p.l == p.l && p.c == b->j->p.c + b->j->n){
-        JOURNAL *j = realloc(b->j, sizeof(JOURNAL) + (b->j->n + n + 1) * sizeof(wchar_t));
-        if (!j)
-            return false;
-        b->j = j;
-        wmemcpy(b->j->s + b->j->n, s, n);
-        b->j->n += n;
-        b->j->s[b->j->n] = 0;
-        return true;
+    if (*n == *na){
+        size_t m = *na? *na * 2 : 64;
+        void *t = realloc(*a, m * w);
+        if (!t)
+            return;
+        *a = t;
+        *na = m;
     }
+    memcpy((char *)*a + (*n)++ * w, x, w);
+}
 
-    if (b->j && b->j->a == MA && a == MA)
-      return true;
-    /* XXX - we can merge more things here */
+static bool
+pinned(const BUFFER *b, const LINE *l)
+{
+    return b->snap && (l->f & SHARED) && !(l->f & (INLINE | BORROWED | ENCODED));
+}
 
-    return false;
+static void
+freerope(BUFFER *b, ROPE *r, unsigned w)
+{
+    for (size_t i = 0; i < r->k; i++)
+        arenafree(&b->text, r->c[i].p, CHUNK_MAX * w);
+    arenafree(&b->text, r->c, r->a * sizeof(CHUNK));
+    arenafree(&b->text, r->t, (r->a + 1) * sizeof(size_t));
+    arenafree(&b->text, r, sizeof(ROPE));
+}
+
+static void
+freetext(BUFFER *b, LINE *l)
+{
+    SNAPSHOT *s = b->snap;
+    if (pinned(b, l))
+        retire((void **)&s->dead, &s->ndead, &s->adead, l, sizeof(LINE));
+    else if (l->f & CHUNKED)
+        freerope(b, l->u.h.p, l->w);
+    else if (l->f & CACHED)
+        arenafree(&b->text, l->u.h.p, l->n * l->w);
+    else if (!(l->f & (INLINE | BORROWED | ENCODED)))
+        arenafree(&b->text, l->u.h.p, l->u.h.a * l->w);
 }
 
+/* Make l's text its own, at least w wide, with room for n characters. */
 static bool
-push(BUFFER *b, action a, POS p, const wchar_t *s, size_t n)
+ensureline(BUFFER *b, LINE *l, size_t n, unsigned w)
 {
-    if (!b->canundo || merge(b, a, p, s, n))
+    if (w < l->w)
+        w = l->w;
+    if (w == l->w && n <= room(l) && !pinned(b, l))
         return true;
 
-    JOURNAL *j = calloc(1, sizeof(JOURNAL) + (n + 1) * sizeof(wchar_t));
-    if (!j)
-        return false;
-    j->prev = b->j;
-    j->a = a;
-    j->p = p;
-    j->n = n;
-    wmemcpy(j->s, s, n);
-    b->j = j;
+    LINE x = {.n = l->n, .w = w, .f = INLINE};
+    if (n * w > TEXT_INLINE){
+        size_t a = l->n? n + n / 2 : n;
+        if (!(x.u.h.p = arenaalloc(&b->text, a * w, &a)))
+            return false;
+        x.u.h.a = a / w;
+        x.f = 0;
+    }
+    if (l->n)
+        copychars(text(&x), w, 0, l, 0, l->n);
+    freetext(b, l);
+    *l = x;
     return true;
 }
 
+/* Make room in r for at least k chunks. */
 static bool
-pop(BUFFER *b)
+ropegrow(BUFFER *b, ROPE *r, size_t k)
 {
-    if (b->j){
-        JOURNAL *j = b->j;
-        b->j = j->prev;
-        free(j);
+    if (k <= r->a)
         return true;
+    size_t a = r->a + r->a / 2 > k? r->a + r->a / 2 : k, x;
+    CHUNK *c = arenaalloc(&b->text, a * sizeof(CHUNK), &x);
+    size_t *t = c? arenaalloc(&b->text, (a + 1) * sizeof(size_t), &x) : NULL;
+    if (!t)
+        return arenafree(&b->text, c, a * sizeof(CHUNK)), false;
+    if (r->a){
+        memcpy(c, r->c, r->k * sizeof(CHUNK));
+        memcpy(t, r->t, (r->k + 1) * sizeof(size_t));
+        arenafree(&b->text, r->c, r->a * sizeof(CHUNK));
+        arenafree(&b->text, r->t, (r->a + 1) * sizeof(size_t));
     }
-    return false;
+    r->c = c;
+    r->t = t;
+    r->a = a;
+    return true;
 }
 
-BUFFER *
-openbuffer(void)
+/* Add text for chunks k to k + m - 1 of r, which has room for them. */
+static bool
+ropechunks(BUFFER *b, ROPE *r, size_t k, size_t m, unsigned w)
 {
-   BUFFER *b = calloc(1, sizeof(BUFFER));
-   if (!b)
-      return NULL;
-   for (int i = 0; i < TAG_MAX; i++)
-      b->tags[i].p1 = b->tags[i].p2 = pos(NONE, NONE);
-   return b;
+    for (size_t i = 0, x; i < m; i++){
+        r->c[k + i].n = 0;
+        if (!(r->c[k + i].p = arenaalloc(&b->text, CHUNK_MAX * w, &x))){
+            while (i--)
+                arenafree(&b->text, r->c[k + i].p, CHUNK_MAX * w);
+            return false;
+        }
+    }
+    return true;
 }
 
-void
-closebuffer(BUFFER *b)
+/* Append n characters of s from column sc to the chunks of r from chunk
+ * *i on, filling each to CHUNK_FILL, and leaving *i at the last used.
+ */
+static void
+ropefill(ROPE *r, size_t *i, unsigned w, const LINE *s, colno sc, size_t n)
 {
-    if (b){
-        while (b->j)
-            pop(b);
-        for (size_t i = 0; i < b->n; i++)
-            free(b->l[i].s);
-        free(b->l);
-        free(b);
+    while (n){
+        CHUNK *k = r->c + *i;
+        if (k->n >= CHUNK_FILL){
+            ++*i;
+            continue;
+        }
+        size_t m = CHUNK_FILL - k->n < n? CHUNK_FILL - k->n : n;
+        copychars(k->p, w, k->n, s, sc, m);
+        k->n += m;
+        sc += m;
+        n -= m;
+    }
+}
+
+static void
+reverse(CHUNK *c, size_t n)
+{
+    for (size_t i = 0; i < n / 2; i++){
+        CHUNK x = c[i];
+        c[i] = c[n - 1 - i];
+        c[n - 1 - i] = x;
     }
 }
 
+/* Make l a chunked line of its own, at least w wide. */
 static bool
-ensurelines(BUFFER *b, size_t n)
+chunkline(BUFFER *b, LINE *l, unsigned w)
 {
-   if (b->a >= n)
-      return true;
-   LINE *l = realloc(b->l, (n + SLACK) * sizeof(LINE));
-   if (!l)
-      return false;
-   b->l = l;
-   b->a = n + SLACK;
-   return true;
+    if (w < l->w)
+        w = l->w;
+    size_t k = l->n? (l->n + CHUNK_FILL - 1) / CHUNK_FILL : 1, x;
+    ROPE *r = arenaalloc(&b->text, sizeof(ROPE), &x);
+    if (!r)
+        return false;
+    *r = (ROPE){0};
+    if (!ropegrow(b, r, k) || !ropechunks(b, r, 0, k, w)){
+        r->k = 0;
+        freerope(b, r, w);
+        return false;
+    }
+
+    size_t i = 0;
+    r->k = k;
+    ropefill(r, &i, w, l, 0, l->n);
+    ropeindex(r);
+    LINE c = {.n = l->n, .w = w, .f = CHUNKED};
+    c.u.h.p = r;
+    freetext(b, l);
+    *l = c;
+    return true;
 }
 
+/* splice for a chunked line d that is its own. The text goes into the
+ * chunk holding c if it fits; otherwise it and the rest of that chunk
+ * are laid out in as many new chunks as they need after it.
+ */
 static bool
-doinsertline(BUFFER *b, lineno l)
+ropesplice(BUFFER *b, LINE *d, colno c, const LINE *s, colno sc, size_t n)
 {
-    if (!ensurelines(b, b->n + 1))
+    unsigned w = needs(s, sc, n);
+    if (w > d->w && !chunkline(b, d, w))
         return false;
+    w = d->w;
 
-    memmove(b->l + l + 1, b->l + l, (b->n - l) * sizeof(LINE));
-    memset(b->l + l, 0, sizeof(LINE));
-    b->n++;
+    ROPE *r = d->u.h.p;
+    colno o = c;
+    size_t i = ropefind(r, &o);
+    CHUNK *k = r->c + i;
+    if (k->n + n <= CHUNK_MAX){
+        memmove(k->p + (o + n) * w, k->p + o * w, (k->n - o) * w);
+        copychars(k->p, w, o, s, sc, n);
+        k->n += n;
+        ropeadd(r, i, n);
+        d->n += n;
+        return true;
+    }
 
-    return b->dirty = true;
+    size_t tn = k->n - o, fit = o < CHUNK_FILL? CHUNK_FILL - o : 0;
+    size_t m = (n + tn - (fit < n + tn? fit : n + tn) + CHUNK_FILL - 1) / CHUNK_FILL;
+    if (!ropegrow(b, r, r->k + m) || !ropechunks(b, r, r->k, m, w))
+        return false;
+
+    /* turn the tail of chunk i and the new chunks at the end round */
+    reverse(r->c + i + 1, r->k - i - 1);
+    reverse(r->c + r->k, m);
+    reverse(r->c + i + 1, r->k - i - 1 + m);
+    r->k += m;
+
+    unsigned char t[CHUNK_MAX * sizeof(uint32_t)];
+    LINE tl = {.n = tn, .w = w, .f = BORROWED};
+    tl.u.h.p = t;
+    k = r->c + i;
+    memcpy(t, k->p + o * w, tn * w);
+    k->n = o;
+    ropefill(r, &i, w, s, sc, n);
+    ropefill(r, &i, w, &tl, 0, tn);
+    ropeindex(r);
+    d->n += n;
+    return true;
 }
 
-static bool
-dodeleteline(BUFFER *b, lineno l)
+/* cut for a chunked line l that is its own. Chunks left empty go, and
+ * the line goes back to being flat if it gets short.
+ */
+static void
+ropecut(BUFFER *b, LINE *l, colno c, size_t n)
 {
-    free(b->l[l].s);
-    memmove(b->l + l, b->l + l + 1, (b->n - l - 1) * sizeof(LINE));
-    b->n--;
-    return b->dirty = true;
+    ROPE *r = l->u.h.p;
+    unsigned w = l->w;
+    colno o = c;
+    size_t i = ropefind(r, &o), j = i;
+    CHUNK *k = r->c + i;
+    l->n -= n;
+    if (o + n < k->n || (o && o + n == k->n) || r->k == 1){
+        memmove(k->p + o * w, k->p + (o + n) * w, (k->n - o - n) * w);
+        k->n -= n;
+        ropeadd(r, i, -n);
+    } else{
+        for (; n; j++, o = 0){
+            k = r->c + j;
+            size_t m = k->n - o < n? k->n - o : n;
+            memmove(k->p + o * w, k->p + (o + m) * w, (k->n - o - m) * w);
+            k->n -= m;
+            n -= m;
+        }
+        size_t z = i;
+        for (size_t x = i; x < r->k; x++){
+            if (r->c[x].n || (z == 0 && x == r->k - 1))
+                r->c[z++] = r->c[x];
+            else
+                arenafree(&b->text, r->c[x].p, CHUNK_MAX * w);
+        }
+        r->k = z;
+        ropeindex(r);
+    }
+
+    LINE x = {0};
+    if (l->n < CHUNK_MIN / 4 && ensureline(b, &x, l->n, w)){
+        copychars(text(&x), w, 0, l, 0, l->n);
+        x.n = l->n;
+        freetext(b, l);
+        *l = x;
+    }
 }
 
+/* Make l a gapped line of its own, at least w wide, with a gap of at
+ * least k characters at column c, which must be within it.
+ */
 static bool
-ensureline(LINE *l, size_t n)
+gapto(BUFFER *b, LINE *l, colno c, size_t k, unsigned w)
 {
-   if (l->a >= n)
-      return true;
-   wchar_t *s = realloc(l->s, (n + SLACK) * sizeof(wchar_t));
-   if (!s)
-      return false;
-   l->s = s;
-   l->a = n + SLACK;
-   return true;
+    if (w < l->w)
+        w = l->w;
+    if (l->f & GAPPED && w == l->w && l->u.h.a - l->n >= k && !pinned(b, l)){
+        unsigned char *t = text(l);
+        size_t gn = l->u.h.a - l->n;
+        if (c < l->g)
+            memmove(t + (c + gn) * w, t + c * w, (l->g - c) * w);
+        else
+            memmove(t + l->g * w, t + (l->g + gn) * w, (c - l->g) * w);
+        l->g = c;
+        return true;
+    }
+
+    size_t a = l->n + k;
+    a = (a + a / 2 + 16) * w;
+    LINE x = {.n = l->n, .w = w, .f = GAPPED, .g = c};
+    if (!(x.u.h.p = arenaalloc(&b->text, a, &a)))
+        return false;
+    x.u.h.a = a / w;
+    copychars(text(&x), w, 0, l, 0, c);
+    copychars(text(&x), w, c + x.u.h.a - l->n, l, c, l->n - c);
+    freetext(b, l);
+    *l = x;
+    return true;
+}
+
+/* Close up the gap in l, which is its own unless it is pinned. */
+static void
+gapclose(BUFFER *b, LINE *l)
+{
+    LINE x = {0};
+    if (!pinned(b, l)){
+        unsigned char *t = text(l);
+        memmove(t + l->g * l->w, t + (l->g + l->u.h.a - l->n) * l->w, (l->n - l->g) * l->w);
+        l->f &= ~GAPPED;
+    } else if (ensureline(b, &x, l->n, l->w)){
+        copychars(text(&x), l->w, 0, l, 0, l->n);
+        x.n = l->n;
+        freetext(b, l);
+        *l = x;
+    }
 }
 
+/* Insert n characters of s from column sc at column c of d, padding d
+ * with spaces if it is shorter than c. s and d must be different lines.
+ */
 static bool
-doinserttext(BUFFER *b, POS p, const wchar_t *s, size_t n)
+splice(BUFFER *b, LINE *d, colno c, const LINE *s, colno sc, size_t n)
 {
     if (!n)
         return true;
-    LINE *l = b->l + p.l;
-    b->dirty = true;
-    if (p.c > l->n){
-        if (!ensureline(l, p.c))
+    size_t pad = c > d->n? c - d->n : 0;
+    if (d->f & CHUNKED || d->n + pad + n > CHUNK_MIN){
+        static char spaces[] = "                                ";
+        if ((!(d->f & CHUNKED) || pinned(b, d)) && !chunkline(b, d, needs(s, sc, n)))
             return false;
-        wmemset(l->s + l->n, L' ', p.c - l->n);
-        l->n = p.c;
+        for (size_t m; pad; pad -= m){
+            LINE v = {.n = m = pad < sizeof(spaces) - 1? pad : sizeof(spaces) - 1, .w = 1, .f = BORROWED};
+            v.u.h.p = spaces;
+            if (!ropesplice(b, d, d->n, &v, 0, m))
+                return false;
+        }
+        return ropesplice(b, d, c, s, sc, n);
     }
-
-    if (!ensureline(l, l->n + n))
+    if (!ensureline(b, d, d->n + pad + n, needs(s, sc, n)))
         return false;
-    wmemmove(l->s + p.c + n, l->s + p.c, l->n - p.c);
-    wmemcpy(l->s + p.c, s, n);
-    l->n += n;
+
+    unsigned char *t = text(d);
+    for (size_t i = 0; i < pad; i++)
+        putch(t, d->w, d->n++, L' ');
+    memmove(t + (c + n) * d->w, t + c * d->w, (d->n - c) * d->w);
+    copychars(t, d->w, c, s, sc, n);
+    d->n += n;
     return true;
 }
 
 static bool
-dodeletetext(BUFFER *b, POS p, size_t n)
+cut(BUFFER *b, LINE *l, colno c, size_t n)
 {
     if (!n)
         return true;
-    LINE *l = b->l + p.l;
-    b->dirty = true;
-    wmemmove(l->s + p.c, l->s + p.c + n, l->n - p.c - n);
+    if (l->f & CHUNKED || l->n > CHUNK_MIN){
+        if ((!(l->f & CHUNKED) || pinned(b, l)) && !chunkline(b, l, l->w))
+            return false;
+        ropecut(b, l, c, n);
+        return true;
+    }
+    if (!ensureline(b, l, l->n, l->w))
+        return false;
+    unsigned char *t = text(l);
+    memmove(t + c * l->w, t + (c + n) * l->w, (l->n - c - n) * l->w);
     l->n -= n;
     return true;
 }
 
-bool
-insertline(BUFFER *b, lineno l)
+LINE
+textline(const wchar_t *s, size_t n)
+{
+    LINE l = {.n = n, .w = sizeof(wchar_t), .f = BORROWED};
+    l.u.h.p = (void *)s;
+    return l;
+}
+
+LINE
+byteline(const char *s, size_t n)
+{
+    LINE l = {.n = n, .f = ENCODED};
+    l.u.h.p = (void *)s;
+    return l;
+}
+
+/* Decode the n bytes at m into d, which must be empty, sizing d once
+ * for the whole line. Bytes that do not decode become RAWBYTEs.
+ */
+static bool
+decodeinto(BUFFER *b, LINE *d, const char *m, size_t n)
 {
-    if (!push(b, IL, pos(l, 0), L"", 0))
+    size_t a = asciispan(m, n), k = 0;
+    if (!isutf8()){
+        wchar_t *s = malloc(n * sizeof(wchar_t));
+        if (!s)
+            return false;
+        k = decodebytes(s, m, n);
+        LINE v = textline(s, k);
+        bool rc = splice(b, d, 0, &v, 0, k);
+        free(s);
+        return rc;
+    }
+
+    unsigned w = 1;
+    wint_t c;
+    for (size_t i = k = a; i < n; ){
+        size_t r = asciispan(m + i, n - i);
+        i += r, k += r;
+        if (i < n){
+            i += utf8decode(m + i, n - i, &c);
+            w = c >= 0x10000? 4 : c >= 0x100 && w < 2? 2 : w;
+            k++;
+        }
+    }
+    if (!ensureline(b, d, k, w))
         return false;
-    if (!doinsertline(b, l))
-        return pop(b), false;
+
+    unsigned char *t = text(d);
+    if (w == 1)
+        memcpy(t, m, a);
+    else for (size_t i = 0; i < a; i++)
+        putch(t, w, i, (unsigned char)m[i]);
+    for (size_t i = a, o = a; i < n; o++){
+        i += utf8decode(m + i, n - i, &c);
+        putch(t, w, o, c);
+    }
+    d->n = k;
     return true;
 }
 
-bool
-deleteline(BUFFER *b, lineno l)
+/* Lines loaded from a mapped file are decoded the first time they are
+ * looked at; until then they cost nothing but their LINE. Lines that
+ * are all ASCII are then used where they lie, and others are CACHED
+ * until they are changed. A CACHED line has no room, so the first
+ * change to it copies its text and it stops being CACHED.
+ */
+static bool
+decode(BUFFER *b, LINE *l)
 {
-    if (!push(b, DL, pos(l, 0), b->l[l].s, b->l[l].n))
+    if (!(l->f & ENCODED))
+        return true;
+    if (asciispan(l->u.h.p, l->n) == l->n){
+        l->w = 1;
+        l->f = BORROWED;
+        return true;
+    }
+
+    LINE x = {0};
+    if (!decodeinto(b, &x, l->u.h.p, l->n))
         return false;
-    if (!dodeleteline(b, l))
-        return pop(b), false;
+    if (!x.f && l->n <= UINT32_MAX){
+        x.f = CACHED;
+        x.u.h.a = (uintptr_t)l->u.h.p;
+        x.g = l->n;
+    }
+    *l = x;
     return true;
 }
 
-bool
-inserttext(BUFFER *b, POS p, const wchar_t *s, size_t n)
+static bool
+merge(BUFFER *b, action a, POS p, size_t n)
+{
+    if (b->j && b->j->a == IL && a == IL && p.l == b->j->p.l + b->j->n){
+        b->j->n += n;
+        return true;
+    }
+
+    if (b->j && b->j->a == MA && a == MA)
+      return true;
+    /* XXX - we can merge more things here */
+
+    return false;
+}
+
+static bool
+push(BUFFER *b, action a, POS p, size_t n)
 {
-    if (!push(b, IT, p, s, n))
+    if (!b->canundo || merge(b, a, p, n))
+        return true;
+
+    JOURNAL *j = calloc(1, sizeof(JOURNAL));
+    if (!j)
         return false;
-    if (!doinserttext(b, p, s, n))
-        return pop(b), false;
+    j->prev = b->j;
+    j->a = a;
+    j->p = p;
+    j->n = n;
+    b->j = j;
     return true;
 }
 
-bool
-deletetext(BUFFER *b, POS p, size_t n)
+static bool
+pop(BUFFER *b)
+{
+    if (b->j){
+        JOURNAL *j = b->j;
+        b->j = j->prev;
+        for (size_t i = 0; j->l && i < j->n; i++)
+            freetext(b, j->l + i);
+        free(j->l);
+        freetext(b, &j->t);
+        free(j);
+        return true;
+    }
+    return false;
+}
+
+/* Journal the n characters of s from column c, about to be inserted (IT)
+ * or deleted (DT) at p. Text typed at the end of the last insertion
+ * joins it.
+ */
+static bool
+pushtext(BUFFER *b, action a, POS p, const LINE *s, colno c, size_t n)
 {
-    if (!push(b, DT, p, b->l[p.l].s + p.c, n))
+    JOURNAL *j = b->j;
+    if (!b->canundo)
+        return true;
+    if (a == IT && j && j->a == IT && j->p.l == p.l && p.c == j->p.c + j->t.n)
+        return splice(b, &j->t, j->t.n, s, c, n);
+    if (!push(b, a, p, 0))
         return false;
-    if (!dodeletetext(b, p, n))
+    if (!splice(b, &b->j->t, 0, s, c, n))
         return pop(b), false;
     return true;
 }
 
-wint_t
-charat(const BUFFER *b, POS p)
+/* Lines are kept in a B+-tree counted by lines: leaves hold runs of
+ * LINEs and interior nodes hold their children, each node knowing how
+ * many lines lie beneath it. Finding, inserting or deleting a line is
+ * O(log n) wherever it lands in the file.
+ *
+ * A leaf that hasn't been used for a while and whose lines are all just
+ * bytes in a source is packed: the LINEs are replaced by the length of
+ * each line as a varint, twice over and plus one when the address of
+ * its bytes follows because they don't start just after the last line's
+ * newline. For a file read from disk that is a byte or two a line rather
+ * than a LINE. A packed leaf is only a NODE as far as its header, and is
+ * unpacked by own() like a node that is shared with a snapshot; see
+ * pack.
+ */
+#define FANOUT 64
+struct NODE{
+    bool leaf;
+    bool packed;  /* the lines follow the header packed */
+    bool used;    /* looked at since pack last came by */
+    bool sized;   /* bytes and chars are known */
+    unsigned gen; /* the buffer's generation when made */
+    size_t k, n;  /* entries used, lines below */
+    size_t bytes, chars; /* the text below, less newlines */
+    union{
+        NODE *c[FANOUT];
+        LINE l[FANOUT];
+    } u;
+};
+
+static unsigned char *
+packing(const NODE *t)
 {
-    if (p.l >= b->n)
-        return WEOF;
-    if (p.c >= b->l[p.l].n)
-        return L' ';
-    return b->l[p.l].s[p.c];
+    return (unsigned char *)t + offsetof(NODE, u);
+}
+
+/* Unpack the lines of packed leaf t into l. */
+static void
+unpack(const NODE *t, LINE *l)
+{
+    const unsigned char *s = packing(t);
+    const char *m = NULL;
+    for (size_t i = 0; i < t->k; i++){
+        size_t v = 0;
+        for (unsigned h = 0; ; h += 7){
+            v |= (size_t)(*s & 0x7f) << h;
+            if (!(*s++ & 0x80))
+                break;
+        }
+        if (v & 1){
+            memcpy(&m, s, sizeof(m));
+            s += sizeof(m);
+        }
+        l[i] = byteline(m, v >> 1);
+        m += (v >> 1) + 1;
+    }
+}
+
+/* The bytes in a source that l could be packed as, or NULL. */
+static const char *
+packable(const LINE *l, size_t *n)
+{
+    *n = l->f & CACHED? l->g : l->n;
+    return l->f & CACHED? (const char *)(uintptr_t)l->u.h.a : linebytes(l);
+}
+
+/* A packed copy of leaf t, or NULL if its lines aren't all bytes in a
+ * source that could be packed.
+ */
+static NODE *
+packleaf(const NODE *t)
+{
+    size_t n = 0, ln;
+    const char *m = NULL, *p;
+    for (size_t i = 0; i < t->k; i++){
+        if (!(p = packable(t->u.l + i, &ln)))
+            return NULL;
+        size_t v = ln * 2 + (p != m);
+        for (n++; v >>= 7; n++)
+            ;
+        if (p != m)
+            n += sizeof(m);
+        m = p + ln + 1;
+    }
+
+    NODE *x = malloc(offsetof(NODE, u) + n);
+    if (!x)
+        return NULL;
+    NODE h = {.leaf = true, .packed = true, .sized = t->sized, .gen = t->gen,
+              .k = t->k, .n = t->n, .bytes = t->bytes, .chars = t->chars};
+    memcpy(x, &h, offsetof(NODE, u));
+    unsigned char *s = packing(x);
+    m = NULL;
+    for (size_t i = 0; i < t->k; i++){
+        p = packable(t->u.l + i, &ln);
+        size_t v = ln * 2 + (p != m);
+        for (; v >= 0x80; v >>= 7)
+            *s++ = v | 0x80;
+        *s++ = v;
+        if (p != m){
+            memcpy(s, &p, sizeof(m));
+            s += sizeof(m);
+        }
+        m = p + ln + 1;
+    }
+    return x;
+}
+
+static size_t
+height(const NODE *t)
+{
+    size_t h = 1;
+    for (; !t->leaf; t = t->u.c[0])
+        h++;
+    return h;
+}
+
+/* Whether t may be in a snapshot, and so must not be changed. */
+static bool
+shared(const BUFFER *b, const NODE *t)
+{
+    return b->snap && t->gen != b->gen;
+}
+
+/* Mark the lines at l, just copied from t, as sharing t's text. */
+static void
+adopt(const BUFFER *b, const NODE *t, LINE *l, size_t n)
+{
+    for (size_t i = 0; shared(b, t) && i < n; i++)
+        l[i].f |= SHARED;
+}
+
+static void
+dropnode(BUFFER *b, NODE *t)
+{
+    SNAPSHOT *s = b->snap;
+    if (t->packed)
+        b->npacked--;
+    if (shared(b, t))
+        retire((void **)&s->nodes, &s->nnodes, &s->anodes, &t, sizeof(NODE *));
+    else
+        free(t);
+}
+
+/* Line text lives in the buffer's arena and goes with it. */
+static void
+freetree(NODE *t)
+{
+    for (size_t i = 0; !t->leaf && i < t->k; i++)
+        freetree(t->u.c[i]);
+    free(t);
+}
+
+/* Nodes needed by a split are set aside before the tree is touched,
+ * so that running out of memory never leaves it half-modified.
+ */
+static bool
+reserve(BUFFER *b, size_t n)
+{
+    while (b->nspare < n){
+        NODE *t = calloc(1, sizeof(NODE));
+        if (!t)
+            return false;
+        t->u.c[0] = b->spare;
+        b->spare = t;
+        b->nspare++;
+    }
+    return true;
+}
+
+static NODE *
+takenode(BUFFER *b, bool leaf)
+{
+    NODE *t = b->spare;
+    b->spare = t->u.c[0];
+    b->nspare--;
+    memset(t, 0, sizeof(NODE));
+    t->leaf = leaf;
+    t->gen = b->gen;
+    return t;
+}
+
+/* Make *t the buffer's own to change, copying it if a snapshot may
+ * share it or unpacking it if it is packed. A spare node must have been
+ * reserved.
+ */
+static NODE *
+own(BUFFER *b, NODE **t)
+{
+    if (shared(b, *t) || (*t)->packed){
+        NODE *x = takenode(b, (*t)->leaf);
+        if ((*t)->packed){
+            unpack(*t, x->u.l);
+            x->k = x->n = (*t)->k;
+            x->used = true;
+            x->sized = (*t)->sized;
+            x->bytes = (*t)->bytes;
+            x->chars = (*t)->chars;
+        } else{
+            memcpy(x, *t, sizeof(NODE));
+            x->gen = b->gen;
+            if (x->leaf)
+                adopt(b, *t, x->u.l, x->k);
+        }
+        dropnode(b, *t);
+        *t = x;
+        b->hleaf = NULL;
+    }
+    return *t;
+}
+
+/* The spare nodes that owning whatever one edit touches might take. */
+static size_t
+ownneed(const BUFFER *b)
+{
+    return b->snap || b->npacked? 4 * height(b->root) + 1 : 0;
+}
+
+/* Count the lines below t again after its entries have changed. The
+ * text below a leaf is left to be measured when it is asked for.
+ */
+static void
+recount(NODE *t)
+{
+    t->sized = !t->leaf;
+    t->bytes = t->chars = 0;
+    if (t->leaf)
+        t->n = t->k;
+    else for (size_t i = t->n = 0; i < t->k; i++){
+        NODE *c = t->u.c[i];
+        t->n += c->n;
+        t->sized = t->sized && c->sized;
+        t->bytes += c->bytes;
+        t->chars += c->chars;
+    }
+}
+
+static size_t
+width(const NODE *t)
+{
+    return t->leaf? sizeof(LINE) : sizeof(NODE *);
+}
+
+static char *
+entry(NODE *t, size_t i)
+{
+    return t->leaf? (char *)(t->u.l + i) : (char *)(t->u.c + i);
+}
+
+/* The most entries per node when n entries are spread evenly over as
+ * few nodes as will hold them.
+ */
+static size_t
+share(size_t n)
+{
+    size_t k = (n + FANOUT - 1) / FANOUT;
+    return (n + k - 1) / k;
+}
+
+/* Append the m entries at x to t, moving on to a fresh node (listed in
+ * out) each time the current one holds cap entries. Returns the node
+ * written last.
+ */
+static NODE *
+spill(BUFFER *b, NODE *t, size_t cap, const char *x, size_t m, NODE **out, size_t *nout)
+{
+    size_t w = width(t);
+    while (m){
+        if (t->k >= cap){
+            recount(t);
+            out[(*nout)++] = t = takenode(b, t->leaf);
+        }
+        size_t c = cap - t->k < m? cap - t->k : m;
+        memcpy(entry(t, t->k), x, c * w);
+        t->k += c;
+        x += c * w;
+        m -= c;
+    }
+    recount(t);
+    return t;
+}
+
+/* Insert the m LINEs at x before line l of t. A node that overflows is
+ * split evenly and its new right siblings are appended to out; tmp is
+ * scratch space of the same size.
+ */
+static void
+insertrun(BUFFER *b, NODE *t, lineno l, const char *x, size_t m, NODE **out, size_t *nout, NODE **tmp)
+{
+    size_t i = l, start = *nout;
+    if (!t->leaf){
+        for (i = 0; i + 1 < t->k && l > t->u.c[i]->n; i++)
+            l -= t->u.c[i]->n;
+        insertrun(b, own(b, t->u.c + i++), l, x, m, out, nout, tmp);
+        if (!(m = *nout - start)){
+            recount(t);
+            return;
+        }
+        memcpy(tmp, out + start, m * sizeof(NODE *));
+        x = (const char *)tmp;
+        *nout = start;
+    }
+
+    char tail[FANOUT * sizeof(LINE)];
+    size_t w = width(t), nt = t->k - i, cap = share(t->k + m);
+    memcpy(tail, entry(t, i), nt * w);
+    t->k = i;
+    spill(b, spill(b, t, cap, x, m, out, nout), cap, tail, nt, out, nout);
+    recount(t);
+}
+
+/* An upper bound on the nodes made by inserting m lines into a tree of
+ * height h, counting any new levels above the root.
+ */
+static size_t
+bulkneed(size_t h, size_t m)
+{
+    size_t need = 0, c = m;
+    for (size_t i = 0; i < h; i++)
+        need += c = (c + FANOUT - 1) / FANOUT;
+    for (c++; c > 1; need += c = (c + FANOUT - 1) / FANOUT)
+        ;
+    return need;
+}
+
+static void
+dropchild(NODE *t, size_t i)
+{
+    memmove(t->u.c + i, t->u.c + i + 1, (t->k - i - 1) * sizeof(NODE *));
+    t->k--;
+}
+
+/* Child i of t has shrunk; drop it if empty or fold it into a neighbour. */
+static void
+rebalance(BUFFER *b, NODE *t, size_t i)
+{
+    NODE *c = t->u.c[i];
+    if (!c->k){
+        dropnode(b, c);
+        dropchild(t, i);
+        return;
+    }
+    if (c->k >= FANOUT / 4 || t->k < 2)
+        return;
+
+    size_t j = i + 1 < t->k? i : i - 1;
+    NODE *l = t->u.c[j], *r = t->u.c[j + 1];
+    if (l->k + r->k > FANOUT)
+        return;
+    own(b, t->u.c + j);
+    l = t->u.c[j];
+    if (r->packed)
+        unpack(r, l->u.l + l->k);
+    else if (l->leaf){
+        memcpy(l->u.l + l->k, r->u.l, r->k * sizeof(LINE));
+        adopt(b, r, l->u.l + l->k, r->k);
+    } else
+        memcpy(l->u.c + l->k, r->u.c, r->k * sizeof(NODE *));
+    l->k += r->k;
+    l->n += r->n;
+    l->sized = l->sized && r->sized;
+    l->bytes += r->bytes;
+    l->chars += r->chars;
+    dropnode(b, r);
+    dropchild(t, j + 1);
+}
+
+/* Move the lines under t to out, or free them if out is NULL, and free t. */
+static void
+drain(BUFFER *b, NODE *t, LINE **out)
+{
+    if (t->packed && *out){ /* its lines have no text to free */
+        unpack(t, *out);
+        *out += t->k;
+    }
+    for (size_t i = 0; !t->packed && i < t->k; i++){
+        LINE x;
+        if (!t->leaf)
+            drain(b, t->u.c[i], out);
+        else{
+            x = t->u.l[i];
+            adopt(b, t, &x, 1);
+            if (*out)
+                *(*out)++ = x;
+            else
+                freetext(b, &x);
+        }
+    }
+    dropnode(b, t);
+}
+
+/* Remove the n lines from line l of t, moving them to out or freeing
+ * them if out is NULL. Subtrees that lie wholly inside the range are
+ * unhooked without being descended into for anything but their text.
+ */
+static void
+removerange(BUFFER *b, NODE *t, lineno l, size_t n, LINE **out)
+{
+    t->n -= n;
+    t->sized = false;
+    if (t->leaf){
+        if (*out){
+            memcpy(*out, t->u.l + l, n * sizeof(LINE));
+            *out += n;
+        } else for (size_t i = 0; i < n; i++)
+            freetext(b, t->u.l + l + i);
+        memmove(t->u.l + l, t->u.l + l + n, (t->k - l - n) * sizeof(LINE));
+        t->k -= n;
+        return;
+    }
+
+    size_t i = 0, j = 0;
+    while (l >= t->u.c[i]->n)
+        l -= t->u.c[i++]->n;
+    for (j = i; n; l = 0){
+        NODE *c = t->u.c[j];
+        size_t m = c->n - l < n? c->n - l : n;
+        n -= m;
+        if (m == c->n){
+            drain(b, c, out);
+            dropchild(t, j);
+        } else
+            removerange(b, own(b, t->u.c + j), l, m, out), j++;
+    }
+    for (j = i + 2; j-- > i; )
+        if (j < t->k)
+            rebalance(b, t, j);
+}
+
+static void
+restructured(BUFFER *b)
+{
+    while (!b->root->leaf && b->root->k == 1){
+        NODE *t = b->root;
+        b->root = t->u.c[0];
+        dropnode(b, t);
+    }
+    if (!b->root->k && !b->root->leaf)
+        b->root->leaf = true;
+    b->n = b->root->n;
+    b->hleaf = NULL;
+}
+
+/* Where the leaf holding line l hangs, with the line it starts at in
+ * *first. Nothing is owned or marked used on the way.
+ */
+static NODE **
+leafat(BUFFER *b, lineno l, lineno *first)
+{
+    NODE **t = &b->root;
+    size_t r = l;
+    while (!(*t)->leaf){
+        size_t i = 0;
+        while (r >= (*t)->u.c[i]->n)
+            r -= (*t)->u.c[i++]->n;
+        t = (*t)->u.c + i;
+    }
+    *first = l - r;
+    return t;
+}
+
+/* Own the nodes down to the leaf holding line l, and make it the hint. */
+static NODE *
+ownleaf(BUFFER *b, lineno l)
+{
+    if (!reserve(b, height(b->root)))
+        return NULL;
+    NODE **t = &b->root;
+    size_t r = l;
+    while (!own(b, t)->leaf){
+        size_t i = 0;
+        while (r >= (*t)->u.c[i]->n)
+            r -= (*t)->u.c[i++]->n;
+        t = (*t)->u.c + i;
+    }
+    b->hfirst = l - r;
+    return b->hleaf = *t;
+}
+
+static LINE *
+findline(const BUFFER *b, lineno l)
+{
+    /* the lookup hint is a cache, not part of the buffer's value */
+    BUFFER *h = (BUFFER *)b;
+    if (b->hleaf && l >= b->hfirst && l - b->hfirst < b->hleaf->k)
+        return b->hleaf->u.l + (l - b->hfirst);
+
+    NODE *t = b->root;
+    h->hfirst = l;
+    while (!t->leaf){
+        size_t i = 0;
+        while (l >= t->u.c[i]->n)
+            l -= t->u.c[i++]->n;
+        t = t->u.c[i];
+    }
+    if (t->packed){
+        static LINE spare[FANOUT]; /* for want of a node to unpack it into */
+        if (ownleaf(h, h->hfirst))
+            return h->hleaf->u.l + l;
+        unpack(t, spare);
+        h->hleaf = NULL;
+        return spare + l;
+    }
+    t->used = true;
+    h->hfirst -= l;
+    h->hleaf = t;
+    return t->u.l + l;
+}
+
+/* Line l, decoded and the buffer's own to change, or NULL. */
+static LINE *
+editline(BUFFER *b, lineno l)
+{
+    if ((b->snap || b->npacked) && (!b->hleaf || shared(b, b->hleaf) || l < b->hfirst || l - b->hfirst >= b->hleaf->k)){
+        if (!ownleaf(b, l))
+            return NULL;
+    }
+    LINE *x = findline(b, l);
+    return decode(b, x)? x : NULL;
+}
+
+static const LINE *
+touch(const BUFFER *b, lineno l)
+{
+    static const LINE empty;
+    LINE *x = findline(b, l);
+    if (x->f & ENCODED)
+        x = editline((BUFFER *)b, l);
+    return x? x : &empty;
+}
+
+/* Each node knows how many bytes and characters of text lie below it,
+ * once it has been asked, so that a byte offset can be found in
+ * O(log n). An edit within a line adds what it changes to the nodes
+ * above it, while a node whose lines change is counted again the next
+ * time it is asked.
+ */
+static void
+resize(BUFFER *b, lineno l, size_t bytes, size_t chars)
+{
+    for (NODE *t = b->root; ; ){
+        t->bytes += bytes;
+        t->chars += chars;
+        if (t->leaf)
+            break;
+        size_t i = 0;
+        while (l >= t->u.c[i]->n)
+            l -= t->u.c[i++]->n;
+        t = t->u.c[i];
+    }
+}
+
+static void
+measure(NODE *t)
+{
+    if (t->sized)
+        return;
+    LINE x[FANOUT];
+    const LINE *l = t->u.l;
+    if (t->packed)
+        unpack(t, x), l = x;
+    t->bytes = t->chars = 0;
+    for (size_t i = 0; i < t->k; i++){
+        size_t c;
+        if (!t->leaf){
+            measure(t->u.c[i]);
+            t->bytes += t->u.c[i]->bytes;
+            t->chars += t->u.c[i]->chars;
+        } else{
+            t->bytes += linesize(l + i, &c);
+            t->chars += c;
+        }
+    }
+    t->sized = true;
+}
+
+BUFFER *
+openbuffer(void)
+{
+   BUFFER *b = calloc(1, sizeof(BUFFER));
+   if (!b)
+      return NULL;
+   if (!(b->root = calloc(1, sizeof(NODE))))
+      return free(b), NULL;
+   b->root->leaf = true;
+   b->gap = NONE;
+   b->head = b->tail = NONE;
+   b->swap = -1;
+   for (int i = 0; i < TAG_MAX; i++)
+      b->tags[i].p1 = b->tags[i].p2 = pos(NONE, NONE);
+   return b;
+}
+
+void
+closebuffer(BUFFER *b)
+{
+    if (b){
+        while (b->j){
+            JOURNAL *j = b->j;
+            b->j = j->prev;
+            free(j->l);
+            free(j);
+        }
+        freetree(b->root);
+        arenarelease(&b->text);
+        while (b->src){
+            SOURCE *f = b->src;
+            b->src = f->next;
+            munmap(f->m, f->n);
+            free(f);
+        }
+        if (b->swap >= 0)
+            close(b->swap);
+        while (b->spare){
+            NODE *t = b->spare;
+            b->spare = t->u.c[0];
+            free(t);
+        }
+        free(b);
+    }
+}
+
+/* Note that the m lines from line l on are to be replaced. */
+static void
+changing(BUFFER *b, lineno l, size_t m)
+{
+    if (l < b->head)
+        b->head = l;
+    if (b->n - l - m < b->tail)
+        b->tail = b->n - l - m;
+}
+
+/* Insert the m LINEs at x before line l; the buffer takes over their text. */
+static bool
+doinsertlines(BUFFER *b, lineno l, const LINE *x, size_t m)
+{
+    size_t need = bulkneed(height(b->root), m) + ownneed(b);
+    NODE *stack[32], **out = stack;
+    if (2 * (need + 1) > sizeof(stack) / sizeof(stack[0])
+    &&  !(out = calloc(2 * (need + 1), sizeof(NODE *))))
+        return false;
+    if (!reserve(b, need)){
+        if (out != stack)
+            free(out);
+        return false;
+    }
+
+    NODE **tmp = out + need + 1;
+    size_t nout = 1;
+    changing(b, l, 0);
+    insertrun(b, own(b, &b->root), l, (const char *)x, m, out, &nout, tmp);
+    for (out[0] = b->root; nout > 1; ){
+        size_t n = nout;
+        memcpy(tmp, out, n * sizeof(NODE *));
+        out[0] = takenode(b, false);
+        nout = 1;
+        spill(b, out[0], share(n), (const char *)tmp, n, out, &nout);
+    }
+    b->root = out[0];
+    if (out != stack)
+        free(out);
+    restructured(b);
+    return b->dirty = true;
+}
+
+static bool
+dodeletelines(BUFFER *b, lineno l, size_t n, LINE *out)
+{
+    if (!reserve(b, ownneed(b)))
+        return false;
+    changing(b, l, n);
+    removerange(b, own(b, &b->root), l, n, &out);
+    restructured(b);
+    return b->dirty = true;
+}
+
+/* Text is put into and taken out of a line that isn't long through a
+ * gap at the point of the edit.
+ */
+static bool
+doinserttext(BUFFER *b, POS p, const LINE *s, colno c, size_t n)
+{
+    closegap(b, p.l);
+    LINE *l = editline(b, p.l);
+    if (!l)
+        return false;
+    if (!n)
+        return true;
+    changing(b, p.l, 1);
+    size_t pad = p.c > l->n? p.c - l->n : 0, chars = pad + n;
+    size_t bytes = pad + textbytes(s, c, n);
+    if (l->f & CHUNKED || l->n + n > CHUNK_MIN || p.c > CHUNK_MIN){
+        if (!splice(b, l, p.c, s, c, n))
+            return false;
+    } else{
+        if (!gapto(b, l, p.c - pad, pad + n, needs(s, c, n)))
+            return false;
+        for (; pad; pad--, l->n++)
+            putch(text(l), l->w, l->g++, L' ');
+        copychars(text(l), l->w, l->g, s, c, n);
+        l->g += n;
+        l->n += n;
+        b->gap = p.l;
+    }
+    resize(b, p.l, bytes, chars);
+    b->dirty = true;
+    return true;
+}
+
+static bool
+dodeletetext(BUFFER *b, POS p, size_t n)
+{
+    closegap(b, p.l);
+    LINE *l = editline(b, p.l);
+    if (!l)
+        return false;
+    if (!n)
+        return true;
+    changing(b, p.l, 1);
+    size_t bytes = textbytes(l, p.c, n);
+    if (l->f & CHUNKED || l->n > CHUNK_MIN){
+        if (!cut(b, l, p.c, n))
+            return false;
+    } else{
+        if (!gapto(b, l, p.c, 0, l->w))
+            return false;
+        l->n -= n;
+        b->gap = p.l;
+    }
+    resize(b, p.l, -bytes, -n);
+    b->dirty = true;
+    return true;
+}
+
+/* Close up the gap left by editing, unless it is in line keep. */
+void
+closegap(BUFFER *b, lineno keep)
+{
+    lineno l = b->gap;
+    if (l == keep || l >= b->n)
+        return;
+    b->gap = NONE;
+    LINE *x = findline(b, l);
+    if (x->f & GAPPED && (x = editline(b, l)) != NULL)
+        gapclose(b, x);
+}
+
+/* When a buffer's text outgrows its ceiling, lines away from the one
+ * being worked on are paged out until it is back under it by an eighth.
+ * A CACHED line goes back to being the bytes it was decoded from, and
+ * any other line with text of its own is encoded into a swap file that
+ * is then mapped as a source of lines like any other, ending each line
+ * with a newline so that saving writes runs of them from where they
+ * lie. Either way the line is decoded again the next time it is used.
+ *
+ * Lines are visited round the buffer from where the last pass stopped,
+ * and a pass looks at no more than PAGE_SCAN of them so as never to
+ * hold up the editor for long. A pass that can't get back under the
+ * ceiling leaves the next to wait until there is more to page out.
+ */
+#define PAGE_NEAR  4096      /* lines either side of the kept one left be */
+#define PAGE_SCAN  (1 << 18) /* lines looked at in a pass */
+#define PAGE_BATCH (1 << 22) /* bytes written to the swap file at once, in pages */
+typedef struct{
+    LINE *l;
+    size_t o, n;
+} PAGED;
+typedef struct{
+    char *s;      /* the encoded lines, each followed by a newline */
+    size_t n, a;
+    PAGED *x;     /* which lines they are and where they lie in s */
+    size_t k, ka;
+    wchar_t *t;   /* for decoding them again to check them */
+    size_t ta;
+    size_t freed; /* the text they will give back */
+} PAGER;
+
+static void
+uncache(BUFFER *b, LINE *l)
+{
+    LINE x = byteline((const char *)(uintptr_t)l->u.h.a, l->g);
+    freetext(b, l);
+    *l = x;
+}
+
+static int
+swapfile(void)
+{
+    char fn[FILENAME_MAX + 1];
+    const char *d = getenv("TMPDIR");
+    snprintf(fn, sizeof(fn), "%s/tine.XXXXXX", d && *d? d : "/tmp");
+    int fd = mkstemp(fn);
+    if (fd >= 0)
+        unlink(fn);
+    return fd;
+}
+
+/* Encode l into p, unless it wouldn't decode to the same text again. */
+static bool
+encodeto(PAGER *p, LINE *l)
+{
+    size_t need = l->n * MB_CUR_MAX + 1;
+    if (p->a - p->n < need){
+        size_t a = p->n + need > PAGE_BATCH? p->n + need : PAGE_BATCH;
+        char *s = realloc(p->s, a);
+        if (!s)
+            return false;
+        p->s = s;
+        p->a = a;
+    }
+    if (p->k == p->ka){
+        size_t a = p->ka? p->ka * 2 : 1024;
+        PAGED *x = realloc(p->x, a * sizeof(PAGED));
+        if (!x)
+            return false;
+        p->x = x;
+        p->ka = a;
+    }
+
+    char *s = p->s + p->n;
+    size_t n = encodeline(l, 0, l->n, s) - s;
+    if (n > p->ta){
+        wchar_t *t = realloc(p->t, n * sizeof(wchar_t));
+        if (!t)
+            return false;
+        p->t = t;
+        p->ta = n;
+    }
+    if (decodebytes(p->t, s, n) != l->n)
+        return false;
+    for (size_t c = 0; c < l->n; c++){
+        if ((wint_t)p->t[c] != getch(l, c))
+            return false;
+    }
+
+    s[n] = '\n';
+    p->x[p->k++] = (PAGED){l, p->n, n};
+    p->n += n + 1;
+    p->freed += l->f & CHUNKED? l->n * l->w : l->u.h.a * l->w;
+    return true;
+}
+
+static bool
+writeat(int fd, const char *s, size_t n, size_t at)
+{
+    for (size_t w = 0; w < n; ){
+        ssize_t r = pwrite(fd, s + w, n - w, at + w);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        w += r;
+    }
+    return true;
+}
+
+/* Write the lines in p to the swap file and make them its bytes. */
+static bool
+swapout(BUFFER *b, PAGER *p)
+{
+    if (!p->k)
+        return true;
+    if (b->swap < 0 && (b->swap = swapfile()) < 0)
+        return false;
+
+    size_t at = b->swapn, base = at - at % sysconf(_SC_PAGESIZE);
+    if (!writeat(b->swap, p->s, p->n, at))
+        return false;
+
+    struct stat st;
+    size_t n = at - base + p->n;
+    char *m = mmap(NULL, n, PROT_READ, MAP_PRIVATE, b->swap, base);
+    if (m == MAP_FAILED)
+        return false;
+    if (fstat(b->swap, &st) != 0 || !addsource(b, m, n, &st))
+        return munmap(m, n), false;
+    b->swapn += p->n;
+
+    for (size_t i = 0; i < p->k; i++){
+        LINE *x = p->x[i].l;
+        LINE y = byteline(m + at - base + p->x[i].o, p->x[i].n);
+        freetext(b, x);
+        *x = y;
+    }
+    return true;
+}
+
+/* Page out text if b is over its ceiling, leaving the lines around keep
+ * as they are. Lines got from lineat before this are no longer good.
+ */
+void
+pageout(BUFFER *b, lineno keep)
+{
+    if (!b->cap || b->text.used <= b->cap || b->text.used <= b->floor || b->snap)
+        return;
+
+    PAGER p = {0};
+    size_t low = b->cap - b->cap / 8;
+    bool swapping = true;
+    for (size_t i = 0; i < PAGE_SCAN && i < b->n && b->text.used - p.freed > low; ){
+        lineno first, l = b->hand < b->n? b->hand : 0;
+        NODE *t = *leafat(b, l, &first); /* packed leaves have no text */
+        b->hand = first + t->k;
+        i += b->hand - l;
+        for (; !t->packed && l < b->hand; l++){
+            if ((l > keep? l - keep : keep - l) <= PAGE_NEAR || l == b->gap)
+                continue;
+
+            LINE *x = t->u.l + (l - first);
+            if (x->f & CACHED)
+                uncache(b, x);
+            else if (swapping && x->n && !(x->f & (INLINE | BORROWED | ENCODED))){
+                encodeto(&p, x);
+                if (p.n >= PAGE_BATCH){
+                    swapping = swapout(b, &p);
+                    p.n = p.k = p.freed = 0;
+                }
+            }
+        }
+    }
+    if (swapping)
+        swapout(b, &p);
+    b->floor = b->text.used > low? b->text.used + b->cap / 16 : 0;
+    free(p.s);
+    free(p.x);
+    free(p.t);
+}
+
+/* Leaves are packed as pack comes round to them, a pass at a time, if
+ * they haven't been used since it last came by: a clock, which is as
+ * good as knowing which were used least recently without the cost of
+ * keeping track. The leaves around the line being worked on are left
+ * be, and nothing is packed while a snapshot is out, which would then
+ * have to be copied.
+ */
+#define PACK_NEAR 1024 /* lines either side of the kept one left be */
+#define PACK_SCAN 1024 /* leaves looked at in a pass */
+static bool
+packat(BUFFER *b, NODE **t)
+{
+    NODE *x = packleaf(*t);
+    if (!x)
+        return false;
+    for (size_t j = 0; j < (*t)->k; j++)
+        freetext(b, (*t)->u.l + j);
+    if (b->hleaf == *t)
+        b->hleaf = NULL;
+    free(*t);
+    *t = x;
+    b->npacked++;
+    return true;
+}
+
+void
+pack(BUFFER *b, lineno keep)
+{
+    if (b->snap || b->root->leaf)
+        return;
+
+    for (size_t i = 0, seen = 0; i < PACK_SCAN && seen < b->n; i++){
+        lineno first, l = b->packhand < b->n? b->packhand : 0;
+        NODE **t = leafat(b, l, &first);
+        lineno end = b->packhand = first + (*t)->k;
+        seen += (*t)->k;
+        if ((*t)->packed || (*t)->used){
+            (*t)->used = false;
+            continue;
+        }
+        if ((keep >= end? keep - end : first > keep? first - keep : 0) > PACK_NEAR
+        &&  (b->gap < first || b->gap >= end))
+            packat(b, t);
+    }
+}
+
+/* How many lines at the start of b and at its end are as they were when
+ * this was last called; false if none have changed since.
+ */
+bool
+changes(BUFFER *b, lineno *head, lineno *tail)
+{
+    *head = b->head;
+    *tail = b->tail;
+    b->head = b->tail = NONE;
+    return *head != NONE;
+}
+
+bool
+insertline(BUFFER *b, lineno l)
+{
+    LINE x = {0};
+    return insertlines(b, l, &x, 1);
+}
+
+/* Journal and insert the lines at x, taking over their text. */
+static bool
+addlines(BUFFER *b, lineno l, const LINE *x, size_t n)
+{
+    JOURNAL *oj = b->j;
+    size_t on = oj? oj->n : 0;
+    if (!push(b, IL, pos(l, 0), n))
+        return false;
+    if (!doinsertlines(b, l, x, n)){
+        if (b->j != oj)
+            pop(b);
+        else if (oj)
+            oj->n = on;
+        return false;
+    }
+    return true;
+}
+
+/* Insert copies of the lines at x, decoding any that are encoded, and
+ * journal them if asked.
+ */
+static bool
+copylines(BUFFER *b, lineno l, const LINE *x, size_t n, bool journal)
+{
+    if (!n)
+        return true;
+    LINE *c = calloc(n, sizeof(LINE));
+    if (!c)
+        return false;
+
+    bool rc = true;
+    for (size_t i = 0; rc && i < n; i++){
+        if (x[i].f & ENCODED)
+            rc = decodeinto(b, c + i, x[i].u.h.p, x[i].n);
+        else
+            rc = splice(b, c + i, 0, x + i, 0, x[i].n);
+    }
+    if (rc)
+        rc = journal? addlines(b, l, c, n) : doinsertlines(b, l, c, n);
+    if (!rc)
+        for (size_t i = 0; i < n; i++)
+            freetext(b, c + i);
+    free(c);
+    return rc;
+}
+
+bool
+insertlines(BUFFER *b, lineno l, const LINE *x, size_t n)
+{
+    return copylines(b, l, x, n, true);
+}
+
+/* Add lines of the file being loaded to the end of the buffer. They are
+ * part of what it started out as rather than edits, so they are neither
+ * journaled nor make it dirty. Lines in one of its sources are left to
+ * be decoded when they are used, and start out packed but for the last
+ * leaf, which the next lines go on to; any others are copied.
+ */
+bool
+appendlines(BUFFER *b, const LINE *x, size_t n, bool mapped)
+{
+    bool d = b->dirty;
+    lineno l = b->n, first;
+    bool rc = mapped? doinsertlines(b, b->n, x, n) : copylines(b, b->n, x, n, false);
+    b->dirty = d;
+    while (rc && mapped && !b->snap && !b->root->leaf && l < b->n){
+        NODE **t = leafat(b, l, &first);
+        if ((l = first + (*t)->k) < b->n && !(*t)->packed)
+            packat(b, t);
+    }
+    return rc;
+}
+
+/* Add the n bytes at s to the end of the last line, as appendlines adds
+ * lines, for a file whose last line was read before it was finished.
+ */
+bool
+appendtext(BUFFER *b, const char *s, size_t n)
+{
+    if (!b->n){
+        LINE x = byteline(s, n);
+        return appendlines(b, &x, 1, false);
+    }
+
+    LINE x = {0};
+    if (!decodeinto(b, &x, s, n))
+        return false;
+    bool d = b->dirty;
+    lineno l = b->n - 1;
+    bool rc = doinserttext(b, pos(l, lineat(b, l)->n), &x, 0, x.n);
+    b->dirty = d;
+    freetext(b, &x);
+    return rc;
+}
+
+/* Make the n bytes mapped at m, from the file st, a source of lines
+ * for b; it is unmapped along with b.
+ */
+bool
+addsource(BUFFER *b, char *m, size_t n, const struct stat *st)
+{
+    SOURCE *f = calloc(1, sizeof(SOURCE));
+    if (!f)
+        return false;
+    f->m = m;
+    f->n = n;
+    f->dev = st->st_dev;
+    f->ino = st->st_ino;
+    f->next = b->src;
+    b->src = f;
+    return true;
+}
+
+/* Stop using the source mapped at m, which no line may lie in. */
+void
+dropsource(BUFFER *b, char *m)
+{
+    for (SOURCE **f = &b->src; *f; f = &(*f)->next){
+        if ((*f)->m == m){
+            SOURCE *x = *f;
+            *f = x->next;
+            munmap(x->m, x->n);
+            free(x);
+            return;
+        }
+    }
+}
+
+bool
+insertmapped(BUFFER *b, lineno l, char *m, size_t n, const struct stat *st)
+{
+    return addsource(b, m, n, st) && insertbytes(b, l, m, n);
+}
+
+/* Insert the lines in the n bytes at m, which lie in one of b's sources,
+ * before line l. They are decoded when they are used.
+ */
+#define MAPPED_MAX 4096
+bool
+insertbytes(BUFFER *b, lineno l, const char *m, size_t n)
+{
+    LINE *x = calloc(MAPPED_MAX, sizeof(LINE));
+    if (!x)
+        return false;
+
+    bool rc = true;
+    const char *p = m, *e = m + n;
+    while (rc && p < e){
+        size_t k = 0;
+        for (; k < MAPPED_MAX && p < e; k++){
+            const char *nl = memchr(p, '\n', e - p);
+            if (!nl)
+                nl = e;
+            x[k] = byteline(p, nl - p);
+            p = nl + 1;
+        }
+        rc = addlines(b, l, x, k);
+        l += k;
+    }
+    free(x);
+    return rc;
+}
+
+bool
+isbacking(const BUFFER *b, const struct stat *st)
+{
+    for (const SOURCE *f = b->src; f; f = f->next){
+        if (f->dev == st->st_dev && f->ino == st->st_ino)
+            return true;
+    }
+    return false;
+}
+
+/* Copy what b has mapped of the file st into its swap file and map the
+ * copy over it, so that its lines stay where they are but no longer go
+ * with the file when it is cut short or written over.
+ */
+bool
+detach(BUFFER *b, const struct stat *st)
+{
+    size_t pg = sysconf(_SC_PAGESIZE);
+    for (SOURCE *f = b->src; f; f = f->next){
+        if (f->dev != st->st_dev || f->ino != st->st_ino)
+            continue;
+        if (b->swap < 0 && (b->swap = swapfile()) < 0)
+            return false;
+
+        struct stat s;
+        size_t at = (b->swapn + pg - 1) / pg * pg;
+        for (size_t o = 0; o < f->n; o += PAGE_BATCH){
+            size_t n = f->n - o < PAGE_BATCH? f->n - o : PAGE_BATCH;
+            if (!writeat(b->swap, f->m + o, n, at + o)
+            ||  mmap(f->m + o, n, PROT_READ, MAP_PRIVATE | MAP_FIXED, b->swap, at + o) == MAP_FAILED)
+                return false;
+            b->swapn = (at + o + n + pg - 1) / pg * pg;
+        }
+        if (fstat(b->swap, &s) != 0)
+            return false;
+        f->dev = s.st_dev;
+        f->ino = s.st_ino;
+    }
+    return true;
+}
+
+bool
+deleteline(BUFFER *b, lineno l)
+{
+    return deletelines(b, l, l);
+}
+
+/* The removed lines themselves go into the journal, and deleting again
+ * at the same line adds to the same record, so undo puts them all back
+ * with one insertion.
+ */
+bool
+deletelines(BUFFER *b, lineno first, lineno last)
+{
+    size_t n = last - first + 1;
+    if (!reserve(b, ownneed(b)))
+        return false;
+    if (!b->canundo)
+        return dodeletelines(b, first, n, NULL);
+
+    LINE *x = NULL;
+    if (b->j && b->j->a == DL && b->j->p.l == first){
+        if (!(x = realloc(b->j->l, (b->j->n + n) * sizeof(LINE))))
+            return false;
+        b->j->l = x;
+        x += b->j->n;
+        b->j->n += n;
+    } else{
+        if (!(x = malloc(n * sizeof(LINE))) || !push(b, DL, pos(first, 0), n))
+            return free(x), false;
+        b->j->l = x;
+    }
+    return dodeletelines(b, first, n, x);
+}
+
+static bool
+insertfrom(BUFFER *b, POS p, const LINE *s, colno c, size_t n)
+{
+    JOURNAL *oj = b->j;
+    size_t on = oj && oj->a == IT? oj->t.n : 0;
+    if (!pushtext(b, IT, p, s, c, n))
+        return false;
+    if (!doinserttext(b, p, s, c, n)){
+        if (b->j != oj)
+            pop(b);
+        else if (b->canundo && on)
+            oj->t.n = on;
+        return false;
+    }
+    return true;
+}
+
+bool
+inserttext(BUFFER *b, POS p, const wchar_t *s, size_t n)
+{
+    LINE v = textline(s, n);
+    return insertfrom(b, p, &v, 0, n);
+}
+
+bool
+copytext(BUFFER *b, POS d, POS s, size_t n)
+{
+    LINE *l = editline(b, s.l);
+    if (!l)
+        return false;
+    if (s.l != d.l)
+        return insertfrom(b, d, l, s.c, n);
+
+    LINE x = {0};
+    bool rc = splice(b, &x, 0, l, s.c, n) && insertfrom(b, d, &x, 0, n);
+    freetext(b, &x);
+    return rc;
+}
+
+bool
+deletetext(BUFFER *b, POS p, size_t n)
+{
+    LINE *l = editline(b, p.l);
+    if (!l || !pushtext(b, DT, p, l, p.c, n))
+        return false;
+    if (!dodeletetext(b, p, n))
+        return pop(b), false;
+    return true;
+}
+
+/* Encode the n characters of l from column c into s in the locale's
+ * encoding, returning the end of the encoding. There must be room for
+ * n * MB_CUR_MAX bytes.
+ */
+char *
+encodeline(const LINE *l, colno c, size_t n, char *s)
+{
+    size_t i = 0;
+    if (l->f & (CHUNKED | GAPPED)){
+        for (; i < n; ){
+            LINE v = span(l, c + i, n - i);
+            s = encodeline(&v, 0, v.n, s);
+            i += v.n;
+        }
+        return s;
+    }
+    if (l->w == 1){
+        const char *t = (const char *)text(l) + c;
+        memcpy(s, t, i = asciispan(t, n));
+        s += i;
+    }
+
+    mbstate_t ms;
+    memset(&ms, 0, sizeof(ms));
+    for (; i < n; i++)
+        s += encodechar(getch(l, c + i), s, &ms);
+    return s;
+}
+
+wchar_t *
+duptext(const BUFFER *b, POS p, size_t *n)
+{
+    const LINE *l = touch(b, p.l);
+    *n = p.c < l->n? l->n - p.c : 0;
+    wchar_t *s = calloc(*n + 1, sizeof(wchar_t));
+    for (size_t i = 0; s && i < *n; i++)
+        s[i] = getch(l, p.c + i);
+    return s;
+}
+
+const LINE *
+lineat(const BUFFER *b, lineno l)
+{
+    return l < b->n? touch(b, l) : NULL;
+}
+
+wint_t
+charat(const BUFFER *b, POS p)
+{
+    if (p.l >= b->n)
+        return WEOF;
+    return linechar(touch(b, p.l), p.c);
+}
+
+/* How many bytes the text takes encoded, with a newline after each
+ * line, and how many characters that is in *chars if it isn't NULL.
+ */
+size_t
+textsize(const BUFFER *b, size_t *chars)
+{
+    measure(b->root);
+    if (chars)
+        *chars = b->root->chars + b->n;
+    return b->root->bytes + b->n;
+}
+
+/* Where byte o of the text lies, counted as by textsize, or the end of
+ * the last line if it is past the end. A byte in the middle of a
+ * character is in that character.
+ */
+POS
+bytepos(const BUFFER *b, size_t o)
+{
+    NODE *t = b->root;
+    lineno l = 0;
+    if (!b->n)
+        return pos(0, 0);
+    measure(t);
+    if (o >= t->bytes + b->n)
+        return pos(b->n - 1, lineat(b, b->n - 1)->n);
+
+    while (!t->leaf){
+        size_t i = 0;
+        for (; o >= t->u.c[i]->bytes + t->u.c[i]->n; i++){
+            o -= t->u.c[i]->bytes + t->u.c[i]->n;
+            l += t->u.c[i]->n;
+        }
+        t = t->u.c[i];
+    }
+    LINE x[FANOUT];
+    const LINE *y = t->u.l;
+    if (t->packed)
+        unpack(t, x), y = x;
+    for (size_t c, n; o > (n = linesize(y, &c)); y++, l++)
+        o -= n + 1;
+
+    const LINE *d = lineat(b, l);
+    colno c = 0;
+    char s[MB_LEN_MAX];
+    mbstate_t ms;
+    memset(&ms, 0, sizeof(ms));
+    for (size_t k; c < d->n && o >= (k = encodechar(getch(d, c), s, &ms)); c++)
+        o -= k;
+    return pos(l, c);
+}
+
+wint_t
+linechar(const LINE *l, colno c)
+{
+    return c < l->n? getch(l, c) : L' ';
+}
+
+/* Copy the characters of l to s, which must have room for l->n, decoding
+ * them if l is ENCODED; returns how many there were.
+ */
+size_t
+linetext(const LINE *l, wchar_t *s)
+{
+    if (l->f & ENCODED)
+        return decodebytes(s, l->u.h.p, l->n);
+    for (colno c = 0; c < l->n; ){
+        LINE v = span(l, c, l->n - c);
+        const unsigned char *t = text(&v);
+        switch (l->w){
+            case 1:
+                for (size_t i = 0; i < v.n; i++)
+                    s[c + i] = t[i];
+                break;
+            case 2:
+                for (size_t i = 0; i < v.n; i++)
+                    s[c + i] = ((const uint16_t *)t)[i];
+                break;
+            default:
+                for (size_t i = 0; i < v.n; i++)
+                    s[c + i] = ((const uint32_t *)t)[i];
+        }
+        c += v.n;
+    }
+    return l->n;
+}
+
+/* The n bytes l was read from, if its text is still just those bytes. */
+const char *
+linebytes(const LINE *l)
+{
+    if (l->f & ENCODED || (l->f & BORROWED && l->w == 1))
+        return l->u.h.p;
+    return NULL;
+}
+
+SNAPSHOT *
+takesnapshot(BUFFER *b)
+{
+    SNAPSHOT *s = b->snap? NULL : calloc(1, sizeof(SNAPSHOT));
+    if (!s)
+        return NULL;
+    s->b = b;
+    s->root = b->root;
+    s->n = b->n;
+    b->snap = s;
+    b->gen++;
+    return s;
+}
+
+/* Another reader of the lines s holds, so that another thread can read
+ * them alongside s's own reader. It must be dropped before s is.
+ */
+SNAPSHOT *
+sharesnapshot(SNAPSHOT *s)
+{
+    SNAPSHOT *r = calloc(1, sizeof(SNAPSHOT));
+    if (!r)
+        return NULL;
+    r->b = s->b;
+    r->of = s;
+    r->root = s->root;
+    r->n = s->n;
+    return r;
+}
+
+/* Line l as it was when s was taken, as it is kept: a line that hasn't
+ * been looked at since it was read is left undecoded, and linebytes
+ * gives its bytes. This touches nothing but s, so it may be called from
+ * another thread. It is NULL if a packed leaf couldn't be unpacked.
+ */
+const LINE *
+snapraw(SNAPSHOT *s, lineno l)
+{
+    if (!s->leaf || l < s->first || l - s->first >= s->leaf->k){
+        NODE *t = s->root;
+        size_t r = l;
+        while (!t->leaf){
+            size_t i = 0;
+            while (r >= t->u.c[i]->n)
+                r -= t->u.c[i++]->n;
+            t = t->u.c[i];
+        }
+        if (t->packed && !s->unpacked && !(s->unpacked = malloc(FANOUT * sizeof(LINE))))
+            return NULL;
+        if (t->packed)
+            unpack(t, s->unpacked);
+        s->first = l - r;
+        s->leaf = t;
+        s->l = t->packed? s->unpacked : t->u.l;
+    }
+
+    return s->l + (l - s->first);
+}
+
+/* The lines of the leaf holding line l as snapraw gives them, with the
+ * first of them in *first and how many in *n, so that a reader can take
+ * them a leaf at a time. They are good until the next call.
+ */
+const LINE *
+snapleaf(SNAPSHOT *s, lineno l, lineno *first, size_t *n)
+{
+    if (!snapraw(s, l))
+        return NULL;
+    *first = s->first;
+    *n = s->leaf->k;
+    return s->l;
+}
+
+/* How many lines there were when s was taken. */
+lineno
+snaplength(const SNAPSHOT *s)
+{
+    return s->n;
+}
+
+/* Line l as it was when s was taken, or NULL if it could not be decoded.
+ * Like snapraw it may be called from another thread, and the line is
+ * only good until the next call.
+ */
+const LINE *
+snapline(SNAPSHOT *s, lineno l)
+{
+    const LINE *x = snapraw(s, l);
+    if (!x || !(x->f & ENCODED))
+        return x;
+    const char *m = x->u.h.p;
+    if (asciispan(m, x->n) == x->n){
+        s->x = *x;
+        s->x.w = 1;
+        s->x.f = BORROWED;
+        return &s->x;
+    }
+    if (x->n > s->sa){
+        wchar_t *t = realloc(s->s, x->n * sizeof(wchar_t));
+        if (!t)
+            return NULL;
+        s->s = t;
+        s->sa = x->n;
+    }
+
+    s->x = textline(s->s, decodebytes(s->s, m, x->n));
+    return &s->x;
+}
+
+/* Let go of s, on the thread that edits its buffer, once its reader is done. */
+void
+dropsnapshot(SNAPSHOT *s)
+{
+    if (s && s->of){
+        free(s->unpacked);
+        free(s->s);
+        free(s);
+    } else if (s){
+        BUFFER *b = s->b;
+        b->snap = NULL;
+        for (size_t i = 0; i < s->nnodes; i++)
+            free(s->nodes[i]);
+        for (size_t i = 0; i < s->ndead; i++)
+            freetext(b, s->dead + i);
+        free(s->nodes);
+        free(s->dead);
+        free(s->unpacked);
+        free(s->s);
+        free(s);
+    }
 }
 
 bool
@@ -231,7 +2358,7 @@ prev(const BUFFER *b, POS *p)
         p->c--;
     else if (p->l){
         p->l--;
-        p->c = b->l[p->l].n;
+        p->c = touch(b, p->l)->n;
     } else
         return false;
     return true;
@@ -242,7 +2369,7 @@ next(const BUFFER *b, POS *p)
 {
     if (p->l == NONE || p->c == NONE || p->l >= b->n)
         return false;
-    else if (p->c < b->l[p->l].n)
+    else if (p->c < touch(b, p->l)->n)
         p->c++;
     else if (p->l < b->n){
         p->l++;
@@ -261,13 +2388,13 @@ attop(const BUFFER *b, POS p)
 bool
 atbot(const BUFFER *b, POS p)
 {
-    return !b->n || (p.l >= b->n - 1 && p.c >= b->l[b->n - 1].n);
+    return !b->n || (p.l >= b->n - 1 && p.c >= touch(b, b->n - 1)->n);
 }
 
 bool
 ateol(const BUFFER *b, POS p)
 {
-    return !b->n || p.l >= b->n || p.c >= b->l[p.l].n;
+    return !b->n || p.l >= b->n || p.c >= touch(b, p.l)->n;
 }
 
 POS
@@ -297,7 +2424,7 @@ mark(BUFFER *b)
 {
    if (b->nbegin)
       return true;
-   return push(b, MA, b->j? b->j->p : pos(NONE, NONE), L"", 0);
+   return push(b, MA, b->j? b->j->p : pos(NONE, NONE), 0);
 }
 
 bool
@@ -311,17 +2438,19 @@ undo(BUFFER *b, POS *p)
     while (b->j && b->j->a != MA && rc){
         switch (b->j->a){
             case IT:
-                rc = dodeletetext(b, b->j->p, b->j->n);
+                rc = dodeletetext(b, b->j->p, b->j->t.n);
                 break;
             case DT:
-                rc = doinserttext(b, b->j->p, b->j->s, b->j->n);
+                rc = doinserttext(b, b->j->p, &b->j->t, 0, b->j->t.n);
                 break;
             case IL:
-                rc = dodeleteline(b, b->j->p.l);
+                rc = dodeletelines(b, b->j->p.l, b->j->n, NULL);
                 break;
             case DL:
-                rc  = doinsertline(b, b->j->p.l)
-                   && doinserttext(b, b->j->p, b->j->s, b->j->n);
+                if ((rc = doinsertlines(b, b->j->p.l, b->j->l, b->j->n))){
+                    free(b->j->l);
+                    b->j->l = NULL;
+                }
                 break;
             case PO:
                 break; /* just grabbing the position */
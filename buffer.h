@@ -3,8 +3,12 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <wchar.h>
 
+#include "arena.h"
+
 #define NONE ((size_t)-1)
 typedef size_t lineno;
 typedef size_t colno;
@@ -13,9 +17,27 @@ struct POS{
     colno c;
 };
 
+/* A line's n characters; see buffer.c for how its text is stored. */
+#define TEXT_INLINE (sizeof(size_t) + sizeof(void *))
 struct LINE{
-    size_t a, n;
-    wchar_t *s;
+    size_t n;
+    union{
+        struct{
+            size_t a;
+            void *p;
+        } h;
+        unsigned char c[TEXT_INLINE];
+    } u;
+    unsigned char w, f;
+    uint32_t g; /* where the gap in gapped text starts */
+};
+
+struct SOURCE{
+    SOURCE *next;
+    char *m;
+    size_t n;
+    dev_t dev;
+    ino_t ino;
 };
 
 struct TAG{
@@ -33,8 +55,23 @@ typedef enum{ /* note that these must be in descending order by priority */
 
 typedef uint64_t txn;
 struct BUFFER{
-    size_t a, n;
-    LINE *l;
+    size_t n;
+    NODE *root, *spare;
+    size_t nspare;
+    NODE *hleaf;
+    lineno hfirst;
+    SOURCE *src;
+    ARENA text;
+    lineno gap; /* the line last given a gap */
+    size_t cap, floor; /* text kept before paging out; text before trying again */
+    lineno hand;       /* where paging out carries on from */
+    int swap;          /* the file changed lines are paged out to, or -1 */
+    size_t swapn;      /* and how much is in it */
+    size_t npacked;    /* leaves packed */
+    lineno packhand;   /* where packing carries on from */
+    unsigned gen;
+    SNAPSHOT *snap;
+    lineno head, tail; /* lines at either end left alone since changes was last asked for */
 
     bool canundo, dirty;
     int nbegin;
@@ -48,11 +85,45 @@ BUFFER *openbuffer(void);
 void closebuffer(BUFFER *b);
 
 bool insertline(BUFFER *b, lineno l);
+bool insertlines(BUFFER *b, lineno l, const LINE *x, size_t n);
+bool insertmapped(BUFFER *b, lineno l, char *m, size_t n, const struct stat *st);
+bool appendlines(BUFFER *b, const LINE *x, size_t n, bool mapped);
+bool appendtext(BUFFER *b, const char *s, size_t n);
+bool insertbytes(BUFFER *b, lineno l, const char *m, size_t n);
+bool addsource(BUFFER *b, char *m, size_t n, const struct stat *st);
+void dropsource(BUFFER *b, char *m);
+bool isbacking(const BUFFER *b, const struct stat *st);
+bool detach(BUFFER *b, const struct stat *st);
 bool inserttext(BUFFER *b, POS p, const wchar_t *s, size_t n);
 bool deleteline(BUFFER *b, lineno l);
+bool deletelines(BUFFER *b, lineno first, lineno last);
 bool deletetext(BUFFER *b, POS p, size_t n);
-
+bool copytext(BUFFER *b, POS d, POS s, size_t n);
+void closegap(BUFFER *b, lineno keep);
+void pageout(BUFFER *b, lineno keep);
+void pack(BUFFER *b, lineno keep);
+bool changes(BUFFER *b, lineno *head, lineno *tail);
+
+LINE textline(const wchar_t *s, size_t n);
+LINE byteline(const char *s, size_t n);
+wchar_t *duptext(const BUFFER *b, POS p, size_t *n);
+char *encodeline(const LINE *l, colno c, size_t n, char *s);
+
+const LINE *lineat(const BUFFER *b, lineno l);
 wint_t charat(const BUFFER *b, POS p);
+size_t textsize(const BUFFER *b, size_t *chars);
+POS bytepos(const BUFFER *b, size_t o);
+wint_t linechar(const LINE *l, colno c);
+size_t linetext(const LINE *l, wchar_t *s);
+const char *linebytes(const LINE *l);
+
+SNAPSHOT *takesnapshot(BUFFER *b);
+SNAPSHOT *sharesnapshot(SNAPSHOT *s);
+const LINE *snapline(SNAPSHOT *s, lineno l);
+const LINE *snapraw(SNAPSHOT *s, lineno l);
+const LINE *snapleaf(SNAPSHOT *s, lineno l, lineno *first, size_t *n);
+lineno snaplength(const SNAPSHOT *s);
+void dropsnapshot(SNAPSHOT *s);
 
 bool prev(const BUFFER *b, POS *p);
 bool next(const BUFFER *b, POS *p);
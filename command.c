@@ -1,10 +1,14 @@
 #include <errno.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
 #include <signal.h>
+#include <sys/mman.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <fcntl.h>
@@ -17,6 +21,7 @@
 #include "command.h"
 #include "editor.h"
 #include "parser.h"
+#include "search.h"
 #include "util.h"
 
 /* UTILITY FUNCTIONS */
@@ -26,6 +31,7 @@ prompt(EDITOR *e, const char *p)
     werase(e->cmdview.w);
     mvwaddstr(e->cmdview.w, 0, 0, p);
     wrefresh(e->cmdview.w);
+    e->held = true;
     KEYSTROKE k = getkeystroke(e, true);
     werase(e->cmdview.w);
     return k.c == L'y' || k.c == L'Y';
@@ -45,11 +51,321 @@ fixblock(VIEW *v)
     settag(v->b, BLOCK, pos(v->bs, 0), pos(v->be, SIZE_MAX - 1), A_REVERSE);
 }
 
+/* Matches of the find target are counted by a thread of their own in a
+ * snapshot of the document, so that counting a large file doesn't hold
+ * up editing. The count is kept as runs of lines and how many matches
+ * start in each, so that after an edit only the runs it touched need to
+ * be counted again: the buffer tells how many lines at either end were
+ * left alone, and the runs between give way to one run to be counted.
+ * A match with spaces in it runs on over the ends of lines, so as many
+ * lines before a change as the target is long go with it. Counting is
+ * stopped whenever the editing thread needs the snapshot, which the
+ * thread looks for between lines, and goes on from where it got to when
+ * it is polled again.
+ */
+#define COUNT_RUN 1024 /* lines counted as a run */
+typedef struct RUN RUN;
+struct RUN{
+    size_t n, k; /* lines, and the matches in them or NONE */
+};
+
+struct COUNT{
+    BUFFER *b;
+    SEARCH *x;
+    RUN *r;
+    size_t nr, ar;
+    size_t reach;   /* lines before a change that a match in it can start in */
+    POS at;         /* the match the cursor was put at */
+    lineno from;    /* the start of the run it is in */
+    size_t before;  /* and how many matches there are from there to it */
+
+    /* the thread, counting lines first on of run i */
+    pthread_t t;
+    pthread_mutex_t m;
+    SNAPSHOT *s;
+    size_t i, n, *k;
+    lineno first;
+    size_t done;    /* runs of COUNT_RUN lines counted */
+    bool running, ok;
+    bool stop, finished; /* under m */
+};
+
+static bool
+stopping(void *p)
+{
+    COUNT *c = p;
+    pthread_mutex_lock(&c->m);
+    bool stop = c->stop;
+    pthread_mutex_unlock(&c->m);
+    return stop;
+}
+
+static void *
+countthread(void *p)
+{
+    COUNT *c = p;
+    int rc = 1;
+    for (size_t i = 0; rc > 0 && i * COUNT_RUN < c->n; i++){
+        lineno l = c->first + i * COUNT_RUN;
+        size_t n = c->n - i * COUNT_RUN < COUNT_RUN? c->n - i * COUNT_RUN : COUNT_RUN;
+        if ((rc = tally(c->x, c->s, l, pos(l + n, 0), stopping, c, c->k + i)) > 0)
+            c->done = i + 1;
+    }
+
+    pthread_mutex_lock(&c->m);
+    c->finished = true;
+    c->ok = rc >= 0;
+    pthread_mutex_unlock(&c->m);
+    return NULL;
+}
+
+/* Make room for m more runs before run i. */
+static bool
+spread(COUNT *c, size_t i, size_t m)
+{
+    if (c->nr + m > c->ar){
+        size_t a = c->ar? c->ar : 64;
+        while (a < c->nr + m)
+            a *= 2;
+        RUN *r = realloc(c->r, a * sizeof(RUN));
+        if (!r)
+            return false;
+        c->r = r;
+        c->ar = a;
+    }
+    memmove(c->r + i + m, c->r + i, (c->nr - i) * sizeof(RUN));
+    c->nr += m;
+    return true;
+}
+
+/* Start counting the first run that hasn't been, if there is one and
+ * the buffer's snapshot is free.
+ */
+static bool
+startcount(COUNT *c)
+{
+    size_t i = 0;
+    lineno first = 0;
+    while (i < c->nr && c->r[i].k != NONE)
+        first += c->r[i++].n;
+    if (i == c->nr || c->b->snap)
+        return true;
+
+    c->i = i;
+    c->first = first;
+    c->n = c->r[i].n;
+    c->done = 0;
+    c->stop = c->finished = false;
+    isutf8(); /* settle the answer before another thread asks */
+    if (!(c->k = malloc((c->n + COUNT_RUN - 1) / COUNT_RUN * sizeof(size_t))))
+        return false;
+    if (!(c->s = takesnapshot(c->b)) || pthread_mutex_init(&c->m, NULL) != 0){
+        dropsnapshot(c->s);
+        free(c->k);
+        return false;
+    }
+    if (pthread_create(&c->t, NULL, countthread, c) != 0){
+        pthread_mutex_destroy(&c->m);
+        dropsnapshot(c->s);
+        free(c->k);
+        return false;
+    }
+    c->running = true;
+    return true;
+}
+
+/* Wait for the thread, and put the runs it counted in place of the run
+ * it was counting, with the rest of that still to be counted.
+ */
+static bool
+endcount(COUNT *c)
+{
+    pthread_join(c->t, NULL);
+    pthread_mutex_destroy(&c->m);
+    dropsnapshot(c->s);
+    c->running = false;
+
+    size_t d = c->done, rest = d * COUNT_RUN < c->n? c->n - d * COUNT_RUN : 0;
+    bool grown = !d || spread(c, c->i, d + !!rest - 1);
+    for (size_t j = 0; grown && j < d; j++){
+        size_t n = c->n - j * COUNT_RUN;
+        c->r[c->i + j] = (RUN){n < COUNT_RUN? n : COUNT_RUN, c->k[j]};
+    }
+    if (grown && d && rest)
+        c->r[c->i + d] = (RUN){rest, NONE};
+    free(c->k);
+    return grown && c->ok;
+}
+
+/* Bring the runs into line with the buffer's edits since they were last
+ * looked at: the lines between those left alone at either end are all
+ * to be counted again, along with any next to them that already were.
+ */
+static bool
+recount(COUNT *c)
+{
+    lineno head, tail;
+    if (!changes(c->b, &head, &tail))
+        return true;
+    c->at = pos(NONE, NONE);
+    head = head > c->reach? head - c->reach : 0;
+
+    size_t i = 0, j = c->nr, h = 0, t = 0;
+    while (i < c->nr && h + c->r[i].n <= head)
+        h += c->r[i++].n;
+    while (j > i && t + c->r[j - 1].n <= tail)
+        t += c->r[--j].n;
+    if (i && c->r[i - 1].k == NONE)
+        h -= c->r[--i].n;
+    if (j < c->nr && c->r[j].k == NONE)
+        t -= c->r[j++].n;
+
+    RUN x = {c->b->n - h - t, NONE};
+    size_t m = x.n? 1 : 0;
+    if (m > j - i && !spread(c, j, m))
+        return false;
+    if (m < j - i){
+        memmove(c->r + i + m, c->r + j, (c->nr - j) * sizeof(RUN));
+        c->nr -= j - i - m;
+    }
+    if (m)
+        c->r[i] = x;
+    return true;
+}
+
+static COUNT *
+opencount(EDITOR *e)
+{
+    const char *err;
+    lineno head, tail;
+    BUFFER *b = e->docview.b;
+    COUNT *c = calloc(1, sizeof(COUNT));
+    if (!c || !(c->x = opensearch(e->find, e->findn, e->finduc, e->findre, &err)))
+        return free(c), NULL;
+    c->b = b;
+    c->reach = e->findre? 0 : e->findn;
+    c->at = pos(NONE, NONE);
+    changes(b, &head, &tail);
+    if (b->n && !spread(c, 0, 1)){
+        closesearch(c->x);
+        free(c);
+        return NULL;
+    }
+    if (b->n)
+        c->r[0] = (RUN){b->n, NONE};
+    return c;
+}
+
+bool
+counting(const EDITOR *e)
+{
+    return e->count && e->count->running;
+}
+
+/* Stop counting, so that the document's snapshot is free, and bring the
+ * count up to date; or throw the count away if asked.
+ */
+void
+stopcount(EDITOR *e, bool forget)
+{
+    COUNT *c = e->count;
+    if (!c)
+        return;
+    if (c->running){
+        pthread_mutex_lock(&c->m);
+        c->stop = true;
+        pthread_mutex_unlock(&c->m);
+        forget = !endcount(c) || forget;
+    }
+    if (forget || !recount(c)){
+        closesearch(c->x);
+        free(c->r);
+        free(c);
+        e->count = NULL;
+    }
+}
+
+/* Notice the end of a count, bring the runs up to date and start on the
+ * next that needs counting. Returns whether a count ended.
+ */
+bool
+pollcount(EDITOR *e)
+{
+    COUNT *c = e->count;
+    if (!c)
+        return false;
+    bool ended = c->running;
+    if (ended){
+        pthread_mutex_lock(&c->m);
+        bool finished = c->finished;
+        pthread_mutex_unlock(&c->m);
+        if (!finished)
+            return false;
+    }
+    stopcount(e, false);
+    if (e->count && !startcount(e->count))
+        stopcount(e, true);
+    return ended;
+}
+
+/* How many matches of the find target there are, once they have all been
+ * counted, and which of them the cursor is at or 0.
+ */
+bool
+counted(const EDITOR *e, size_t *nth, size_t *total)
+{
+    const COUNT *c = e->count;
+    POS p = e->docview.p;
+    *nth = *total = 0;
+    if (!c)
+        return false;
+    for (size_t i = 0, l = 0; i < c->nr; l += c->r[i++].n){
+        if (c->r[i].k == NONE)
+            return false;
+        if (l < c->from)
+            *nth += c->r[i].k;
+        *total += c->r[i].k;
+    }
+    const TAG *h = c->b->tags + HIGHLIGHT;
+    if (c->at.l == p.l && c->at.c == p.c && h->p1.l == p.l && h->p1.c == p.c)
+        *nth += c->before + 1;
+    else
+        *nth = 0;
+    return true;
+}
+
+/* Count the matches in s from the start of the run p lies in up to p, so
+ * that which match p is is known once the runs before it are counted. A
+ * run that hasn't been counted is split at p's line first.
+ */
+static void
+countto(COUNT *c, SNAPSHOT *s, POS p)
+{
+    size_t i = 0;
+    lineno first = 0;
+    while (i < c->nr && first + c->r[i].n <= p.l)
+        first += c->r[i++].n;
+    if (i < c->nr && c->r[i].k == NONE && first < p.l){
+        if (!spread(c, i, 1))
+            return;
+        c->r[i] = (RUN){p.l - first, NONE};
+        c->r[i + 1].n -= p.l - first;
+        first = p.l;
+    }
+    if (tally(c->x, s, first, p, NULL, NULL, &c->before) > 0){
+        c->from = first;
+        c->at = p;
+    }
+}
+
 static bool
 setfind(EDITOR *e, const wchar_t *s, size_t n)
 {
     free(e->find);
+    closesearch(e->finder);
+    stopcount(e, true);
     e->find = NULL;
+    e->finder = NULL;
     e->findn = 0;
 
    if (n){
@@ -61,54 +377,221 @@ setfind(EDITOR *e, const wchar_t *s, size_t n)
     return true;
 }
 
-static wint_t
-identity(wint_t wc)
+/* A search through many lines is split into parts of FIND_PART lines,
+ * counted on from the place it starts at, that threads each with a
+ * search and a reader of the snapshot of their own take in turn. Once a
+ * part has a place in it the parts after it needn't be looked at, and
+ * since parts are taken in order the search is over when those before it
+ * are done: the place in the first part with one is the first there is,
+ * or if back the last. The editing thread waits for them, and a key
+ * being pressed gives up the search and is put back to be taken as usual.
+ */
+#define FIND_PART  (1 << 16) /* lines searched at a time */
+#define FIND_PARTS 16        /* the most threads searching */
+#define FIND_TICK  20        /* milliseconds between looks for a key */
+typedef struct HUNT HUNT;
+typedef struct HUNTER HUNTER;
+struct HUNTER{
+    pthread_t t;
+    HUNT *h;
+    SEARCH *x;
+    SNAPSHOT *s;
+};
+
+struct HUNT{
+    pthread_mutex_t m;
+    pthread_cond_t c;
+    POS p;
+    bool back;
+    size_t parts;
+
+    /* under m */
+    size_t next, best; /* the part to take next, and the first with a place */
+    POS at;
+    size_t len, running;
+    bool cancel, failed;
+};
+
+static void *
+huntthread(void *p)
+{
+    HUNTER *w = p;
+    HUNT *h = w->h;
+    pthread_mutex_lock(&h->m);
+    while (!h->cancel && !h->failed && h->next < h->best){
+        size_t i = h->next++;
+        pthread_mutex_unlock(&h->m);
+
+        lineno d = i * FIND_PART, l = h->back? h->p.l - d : h->p.l + d;
+        lineno stop = h->back? (l < FIND_PART? 0 : l - FIND_PART + 1) : l + FIND_PART - 1;
+        POS at, from = i? pos(l, h->back? NONE : 0) : h->p;
+        size_t len;
+        int rc = search(w->x, w->s, from, h->back, stop, &at, &len);
+
+        pthread_mutex_lock(&h->m);
+        if (rc < 0)
+            h->failed = true;
+        else if (rc && i < h->best){
+            h->best = i;
+            h->at = at;
+            h->len = len;
+        }
+    }
+    h->running--;
+    pthread_cond_signal(&h->c);
+    pthread_mutex_unlock(&h->m);
+    return NULL;
+}
+
+/* search for e's target in s, from p on to the end or if back to the
+ * start, on as many threads as it is worth; -2 if a key gave it up.
+ */
+static int
+hunt(EDITOR *e, SNAPSHOT *s, POS p, bool back, POS *at, size_t *n)
 {
-    return wc;
+    HUNT h = {.p = p, .back = back};
+    h.parts = ((back? p.l + 1 : snaplength(s) - p.l) + FIND_PART - 1) / FIND_PART;
+    if (h.parts < 2)
+        return search(e->finder, s, p, back, back? 0 : NONE, at, n);
+
+    long np = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nw = np < 1? 1 : (size_t)np;
+    if (nw > h.parts)
+        nw = h.parts;
+    if (nw > FIND_PARTS)
+        nw = FIND_PARTS;
+    HUNTER w[FIND_PARTS] = {{0}};
+    w[0].x = e->finder;
+    w[0].s = s;
+    for (size_t i = 1; i < nw; i++){
+        const char *err;
+        if (!(w[i].x = opensearch(e->find, e->findn, e->finduc, e->findre, &err))
+        ||  !(w[i].s = sharesnapshot(s))){
+            closesearch(w[i].x);
+            nw = i;
+        }
+    }
+
+    int rc = -1;
+    h.best = h.parts;
+    if (pthread_mutex_init(&h.m, NULL) != 0)
+        goto out;
+    if (pthread_cond_init(&h.c, NULL) != 0){
+        pthread_mutex_destroy(&h.m);
+        goto out;
+    }
+    size_t k = 0;
+    for (; k < nw; k++){
+        w[k].h = &h;
+        h.running++;
+        if (pthread_create(&w[k].t, NULL, huntthread, w + k) != 0){
+            h.running--;
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&h.m);
+    if (!k)
+        h.failed = true;
+    while (h.running){
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        long us = tv.tv_usec + FIND_TICK * 1000L;
+        struct timespec ts = {tv.tv_sec + us / 1000000, us % 1000000 * 1000};
+        if (pthread_cond_timedwait(&h.c, &h.m, &ts) == ETIMEDOUT && !h.cancel){
+            pthread_mutex_unlock(&h.m);
+            KEYSTROKE k = getkeystroke(e, false);
+            if (k.o == KEY_CODE_YES)
+                ungetch(k.c);
+            else if (k.o != ERR)
+                unget_wch(k.c);
+            pthread_mutex_lock(&h.m);
+            h.cancel = k.o != ERR;
+        }
+    }
+    pthread_mutex_unlock(&h.m);
+    for (size_t i = 0; i < k; i++)
+        pthread_join(w[i].t, NULL);
+    pthread_cond_destroy(&h.c);
+    pthread_mutex_destroy(&h.m);
+
+    rc = h.cancel? -2 : h.failed? -1 : h.best < h.parts;
+    *at = h.at;
+    *n = h.len;
+
+out:
+    for (size_t i = 1; i < nw; i++){
+        closesearch(w[i].x);
+        dropsnapshot(w[i].s);
+    }
+    return rc;
 }
 
+/* Find the target from just past op, or just before it if r, with how
+ * many characters were found in *n; a buffer has one snapshot at a time,
+ * so counting is stopped and a save holding it is let finish first. The
+ * target is kept compiled, and its matches counted, for as long as it
+ * and the way it is searched for stay the same.
+ */
 static bool
-find(EDITOR *e, VIEW *v, POS op, bool r)
+find(EDITOR *e, VIEW *v, POS op, bool r, size_t *n)
 {
     BUFFER *b = v->b;
-    bool (*iter)(const BUFFER *, POS *) = r? prev : next;
-    bool (*atend)(const BUFFER *b, POS) = r? attop : atbot;
-    wint_t (*xform)(wint_t w) = v->uc? towupper : identity;
+    const char *err;
     if (!e->find || !e->findn)
         return error(e, "Empty target");
+    if (e->finder && (e->finduc != v->uc || e->findre != v->re)){
+        closesearch(e->finder);
+        stopcount(e, true);
+        e->finder = NULL;
+    }
+    if (!e->finder && !(e->finder = opensearch(e->find, e->findn, v->uc, v->re, &err)))
+        return error(e, err);
+    e->finduc = v->uc;
+    e->findre = v->re;
+    if (!e->count)
+        e->count = opencount(e);
 
     cleartag(b, HIGHLIGHT);
-    do{
-        if (!iter(b, &op))
-            return error(e, "Search failed");
-        POS p = op;
-        size_t i = 0;
-        while (i < e->findn && xform((wint_t)e->find[i]) == xform(charat(b, p))){
-            i++;
-            next(b, &p);
-        }
-        if (i == e->findn){
-            v->p = op;
-            settag(b, HIGHLIGHT, op, p, A_UNDERLINE | A_BOLD);
-            if (e->focusview == &e->cmdview)
-               settag(b, VIRTCURS, op, pos(op.l, op.c + 1), A_REVERSE);
-            redisplay(&e->docview);
-            return true;
-        }
-    } while (!atend(b, op));
-
-    return error(e, "Search failed");
+    POS p = op;
+    if (!(r? prev(b, &p) : next(b, &p)))
+        return error(e, "Search failed");
+    stopcount(e, false);
+    if (b->snap)
+        finishsave(e, true);
+    SNAPSHOT *s = takesnapshot(b);
+    int rc = s? hunt(e, s, p, r, &p, n) : -1;
+    if (rc > 0 && e->count && b == e->count->b)
+        countto(e->count, s, p);
+    dropsnapshot(s);
+    if (rc == -2)
+        return error(e, "Search interrupted");
+    if (rc < 0)
+        return error(e, "Out of memory");
+    if (!rc)
+        return error(e, "Search failed");
+
+    POS q = p;
+    for (size_t i = 0; i < *n; i++)
+        next(b, &q);
+    v->p = p;
+    settag(b, HIGHLIGHT, p, q, A_UNDERLINE | A_BOLD);
+    if (e->focusview == &e->cmdview)
+       settag(b, VIRTCURS, p, pos(p.l, p.c + 1), A_REVERSE);
+    redisplay(&e->docview);
+    return true;
 }
 
 static bool
 exchange(EDITOR *e, VIEW *v, const ARG *a, bool query)
 {
+    size_t n;
     if (a->n1 && !setfind(e, a->s1, a->n1))
         return false;
-    if (!find(e, v, v->p, false))
+    if (!find(e, v, v->p, false, &n))
         return false;
     if (!query || prompt(e, "Exchange?")){
-        if (!deletetext(v->b, v->p, a->n1)
+        if (!deletetext(v->b, v->p, n)
         ||  !inserttext(v->b, v->p, a->s2, a->n2))
             return false;
     }
@@ -120,7 +603,7 @@ static size_t
 trimlength(const LINE *l)
 {
    size_t n = l->n;
-   while (n && iswspace(l->s[n - 1]))
+   while (n && iswspace(linechar(l, n - 1)))
       n--;
    return n;
 }
@@ -131,6 +614,8 @@ safewrite(int fd, const char *s, size_t n)
    ssize_t nw = 0;
    while ((size_t)nw < n){
       ssize_t w = write(fd, s + nw, n - nw);
+      if (w < 0 && errno == EINTR)
+         continue;
       if (w < 0)
          return false;
       nw += w;
@@ -138,31 +623,328 @@ safewrite(int fd, const char *s, size_t n)
    return true;
 }
 
+#define WRITE_MAX (1 << 20)
+
+/* trimlength for a line that is still in the bytes it was read from, or
+ * SIZE_MAX if that can't be told without decoding it.
+ */
+static size_t
+trimbytes(const char *m, size_t n)
+{
+   while (n){
+      unsigned char c = m[n - 1];
+      if (c < 0x80 && iswspace(c)){
+         n--;
+         continue;
+      }
+      if (c < 0x80)
+         break;
+      if (!isutf8())
+         return SIZE_MAX;
+
+      size_t i = n - 1;
+      while (i && n - i < 4 && (m[i] & 0xc0) == 0x80)
+         i--;
+      wint_t w;
+      if (utf8decode(m + i, n - i, &w) != n - i || !iswspace(w))
+         break;
+      n = i;
+   }
+   return n;
+}
+
+/* Write the run of unchanged lines at s, which are n bytes less their
+ * last newline, after what is held in o. Short runs are just added to
+ * o, but long ones are written from where they lie.
+ */
+#define WRITE_RUN 65536
 static bool
-writelines(int fd, EDITOR *e, const BUFFER *b, lineno ls, lineno le)
-{
-   char *s = NULL;
-   bool rc = true;
-   for (lineno l = ls; rc && b->n && l <= le; l++){
-      if (b->l[l].n){
-         size_t n = trimlength(&b->l[l]);
-         if (n){
-            s = wstos(b->l[l].s, n);
-            if (!s)
-               return close(fd), error(e, "Out of memory");
-            if (!(rc = safewrite(fd, s, strlen(s)))){
-               int err = errno;
-               free(s);
-               close(fd);
-               return error(e, strerror(err));
-            }
-            free(s);
+writerun(int fd, const char *s, size_t n, char *o, size_t *on)
+{
+   if (!s)
+      return true;
+   if (n >= WRITE_RUN){
+      if (!safewrite(fd, o, *on) || !safewrite(fd, s, n))
+         return false;
+      *on = 0;
+      n = 0;
+   }
+   for (size_t k; n; s += k, n -= k){
+      if (*on == WRITE_MAX && !safewrite(fd, o, *on))
+         return false;
+      if (*on == WRITE_MAX)
+         *on = 0;
+      k = WRITE_MAX - *on < n? WRITE_MAX - *on : n;
+      memcpy(o + *on, s, k);
+      *on += k;
+   }
+   if (*on == WRITE_MAX && !safewrite(fd, o, *on))
+      return false;
+   if (*on == WRITE_MAX)
+      *on = 0;
+   o[(*on)++] = '\n';
+   return true;
+}
+
+/* Lines ls to le, as given by get, are encoded one after another into
+ * the large buffer o, which is written out whenever it fills. Lines that
+ * are still the bytes they were read from aren't encoded at all, and
+ * runs of them that lie together are written in one piece.
+ */
+typedef const LINE *(*getter)(void *p, lineno l, bool raw);
+static bool
+writelines(int fd, getter get, void *p, lineno ls, lineno le, char *o)
+{
+   size_t on = 0, mb = MB_CUR_MAX, rn = 0;
+   const char *rs = NULL; /* the run of unchanged lines being gathered */
+   bool open = false, rc = true;
+   for (lineno l = ls; rc && l <= le; l++){
+      const LINE *x = get(p, l, true);
+      if (!x)
+         return (errno = ENOMEM), false;
+      const char *m = linebytes(x);
+      size_t n = m? trimbytes(m, x->n) : trimlength(x);
+      if (m && n != SIZE_MAX){
+         if (open && m == rs + rn + 1 && rs[rn] == '\n')
+            rn += 1 + n;
+         else{
+            rc = writerun(fd, rs, rn, o, &on);
+            rs = m;
+            rn = n;
          }
+         open = n == x->n;
+         continue;
       }
-      safewrite(fd, "\n", strlen("\n"));
+
+      rc = writerun(fd, rs, rn, o, &on);
+      rs = NULL;
+      open = false;
+      if (m && (x = get(p, l, false)) == NULL)
+         return (errno = ENOMEM), false;
+      if (m)
+         n = trimlength(x);
+      for (size_t c = 0; rc && c < n;){
+         size_t k = (WRITE_MAX - on) / mb;
+         if (k > n - c)
+            k = n - c;
+         if (!k)
+            rc = safewrite(fd, o, on), on = 0;
+         else
+            on = encodeline(x, c, k, o + on) - o, c += k;
+      }
+      if (rc && on == WRITE_MAX)
+         rc = safewrite(fd, o, on), on = 0;
+      if (rc)
+         o[on++] = '\n';
    }
-   close(fd);
-   return true;
+   return rc && writerun(fd, rs, rn, o, &on) && safewrite(fd, o, on);
+}
+
+static const LINE *
+bufferline(void *b, lineno l, bool raw)
+{
+   (void)raw;
+   return lineat(b, l);
+}
+
+static const LINE *
+snapshotline(void *s, lineno l, bool raw)
+{
+   return raw? snapraw(s, l) : snapline(s, l);
+}
+
+/* A file is saved by a thread of its own from a snapshot of the buffer,
+ * so that editing can go on while it is written. It is written to a new
+ * file beside the old one that is then renamed over it, so a save that
+ * fails part way leaves the old file as it was; this also keeps a file
+ * that backs lazily loaded lines from being truncated under them.
+ */
+#define SAVE_STEP 65536 /* lines written between progress reports */
+struct SAVE{
+    pthread_t t;
+    pthread_mutex_t m;
+    BUFFER *b;
+    SNAPSHOT *s;
+    char *fn, *tmp, *o;
+    int fd;
+    struct stat st; /* the file written, as it will be found once renamed */
+    lineno ls;
+    size_t n;
+    bool clean; /* the whole buffer is being saved */
+
+    /* shared with the thread, under m */
+    size_t done;
+    bool finished, ok;
+    int err;
+};
+
+static void *
+savethread(void *p)
+{
+    SAVE *s = p;
+    bool rc = true;
+    for (size_t i = 0, k; rc && i < s->n; i += k){
+        k = s->n - i < SAVE_STEP? s->n - i : SAVE_STEP;
+        rc = writelines(s->fd, snapshotline, s->s, s->ls + i, s->ls + i + k - 1, s->o);
+        pthread_mutex_lock(&s->m);
+        s->done = i + k;
+        pthread_mutex_unlock(&s->m);
+    }
+    if (rc && fsync(s->fd) != 0 && errno != EINVAL)
+        rc = false;
+    int err = errno;
+    if (close(s->fd) != 0 && rc)
+        rc = false, err = errno;
+    if (rc && s->tmp && rename(s->tmp, s->fn) != 0)
+        rc = false, err = errno;
+    if (!rc && s->tmp)
+        unlink(s->tmp);
+
+    pthread_mutex_lock(&s->m);
+    s->finished = true;
+    s->ok = rc;
+    s->err = err;
+    pthread_mutex_unlock(&s->m);
+    return NULL;
+}
+
+static void
+freesave(SAVE *s)
+{
+    if (s){
+        dropsnapshot(s->s);
+        free(s->fn);
+        free(s->tmp);
+        free(s->o);
+        free(s);
+    }
+}
+
+/* Open a new file to be renamed over fn, if fn is a regular file or
+ * doesn't exist yet, giving it fn's owner and permissions. A file with
+ * other links to it, or whose owner or permissions can't be given to
+ * the new one, is left to be written in place.
+ */
+static int
+opentemp(SAVE *s, const char *fn)
+{
+    struct stat st;
+    bool exists = stat(fn, &st) == 0;
+    if (exists && ((st.st_mode & S_IFMT) != S_IFREG || st.st_nlink > 1))
+        return -1;
+    if (!(s->fn = exists? realpath(fn, NULL) : strdup(fn))
+    ||  !(s->tmp = malloc(strlen(s->fn) + sizeof(".XXXXXX"))))
+        return -1;
+
+    sprintf(s->tmp, "%s.XXXXXX", s->fn);
+    int fd = mkstemp(s->tmp);
+    if (fd < 0)
+        return -1;
+    mode_t u = umask(0);
+    umask(u);
+    if ((exists && fchown(fd, st.st_uid, st.st_gid) != 0)
+    ||  fchmod(fd, exists? st.st_mode & 07777 : 0644 & ~u) != 0){
+        close(fd);
+        unlink(s->tmp);
+        return -1;
+    }
+    return fd;
+}
+
+static bool
+startsave(EDITOR *e, BUFFER *b, const char *fn, lineno ls, size_t n, bool clean)
+{
+    finishload(e, false);
+    finishsave(e, true);
+    stopcount(e, false);
+    if (strcmp(fn, e->name) == 0)
+        stopfollow(e, true); /* what is written over it is all there is of it */
+    SAVE *s = calloc(1, sizeof(SAVE));
+    if (!s || !(s->o = malloc(WRITE_MAX)))
+        return freesave(s), error(e, "Out of memory");
+
+    struct stat st;
+    if ((s->fd = opentemp(s, fn)) < 0){
+        free(s->tmp);
+        s->tmp = NULL;
+        if (stat(fn, &st) == 0 && isbacking(b, &st) && !detach(b, &st))
+            return freesave(s), error(e, "Could not copy file");
+        s->fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (s->fd < 0 || fstat(s->fd, &s->st) != 0){
+        if (s->fd >= 0)
+            close(s->fd);
+        if (s->tmp)
+            unlink(s->tmp);
+        return freesave(s), error(e, "Could not open file");
+    }
+
+    s->b = b;
+    s->ls = ls;
+    s->n = n;
+    s->clean = clean;
+    isutf8(); /* settle the answer before another thread asks */
+    if (!(s->s = takesnapshot(b))
+    ||  pthread_mutex_init(&s->m, NULL) != 0){
+        close(s->fd);
+        if (s->tmp)
+            unlink(s->tmp);
+        return freesave(s), error(e, "Out of memory");
+    }
+    if (pthread_create(&s->t, NULL, savethread, s) != 0){
+        pthread_mutex_destroy(&s->m);
+        close(s->fd);
+        if (s->tmp)
+            unlink(s->tmp);
+        return freesave(s), error(e, "Could not start save");
+    }
+
+    e->save = s;
+    if (clean)
+        b->dirty = false;
+    return true;
+}
+
+/* Notice the end of the running save, waiting for it if asked; returns
+ * false only if it failed, in which case its buffer is changed again.
+ */
+bool
+finishsave(EDITOR *e, bool wait)
+{
+    SAVE *s = e->save;
+    if (!s)
+        return true;
+    pthread_mutex_lock(&s->m);
+    bool finished = s->finished;
+    pthread_mutex_unlock(&s->m);
+    if (!finished && !wait)
+        return true;
+
+    pthread_join(s->t, NULL);
+    pthread_mutex_destroy(&s->m);
+    e->save = NULL;
+    bool rc = s->ok || error(e, strerror(s->err));
+    if (!rc && s->clean)
+        s->b->dirty = true;
+    struct stat st;
+    if (rc && stat(e->name, &st) == 0
+    &&  st.st_dev == s->st.st_dev && st.st_ino == s->st.st_ino)
+        e->disk = st; /* it was the file being edited that was written */
+    freesave(s);
+    return rc;
+}
+
+/* How much of the running save is done, as a percentage, or -1. */
+int
+saveprogress(EDITOR *e)
+{
+    SAVE *s = e->save;
+    if (!s)
+        return -1;
+    pthread_mutex_lock(&s->m);
+    size_t done = s->done;
+    pthread_mutex_unlock(&s->m);
+    return s->n? (int)((double)done * 100 / s->n) : 100;
 }
 
 /* COMMAND DEFINITIONS */
@@ -173,14 +955,26 @@ enum{
    NEEDSLINES   = 1L<<2,
    NEEDSBLOCK   = 1L<<3,
    SETSHILITE   = 1L<<4,
-   NOLOCATOR    = 1L<<5
+   NOLOCATOR    = 1L<<5,
+   WHOLEFILE    = 1L<<6
 };
 
+/* A command that looks for the end of the file or searches it waits for
+ * all of it to be read, and any other waits for the line after the
+ * cursor, so that what it does lands where it would once it has all been
+ * read.
+ */
+static void loadthrough(EDITOR *e, lineno l);
+
 #define COMMAND(name, fflags)                                                    \
    bool                                                                          \
    cmd_ ## name (EDITOR *e, VIEW *v, const ARG *a)                               \
    {                                                                             \
       long flags = fflags;                                                       \
+      if (flags & WHOLEFILE)                                                     \
+         finishload(e, false);                                                   \
+      else if (v == &e->docview)                                                 \
+         loadthrough(e, v->p.l + 1);                                             \
       BUFFER *b = v->b; (void)b;                                                 \
       POS p = v->p; (void)p;                                                     \
       lineno ol = p.l;                                                           \
@@ -222,7 +1016,7 @@ COMMAND(ai, NOLOCATOR) /* autoindent */
    v->ai = true;
 END
 
-COMMAND(b, MARK | NOLOCATOR) /* move to bottom of file */
+COMMAND(b, MARK | NOLOCATOR | WHOLEFILE) /* move to bottom of file */
    v->p = pos(b->n? b->n - 1 : 0, 0);
 END
 
@@ -241,8 +1035,9 @@ COMMAND(be, NOLOCATOR) /* block end at cursor line */
    v->be = p.l;
 END
 
-COMMAND(bf, MARK | SETSHILITE | NOLOCATOR) /* backwards find */
-   RETURN((!a->n1 || setfind(e, a->s1, a->n1)) && find(e, v, p, true));
+COMMAND(bf, MARK | SETSHILITE | NOLOCATOR | WHOLEFILE) /* backwards find */
+   size_t n;
+   RETURN((!a->n1 || setfind(e, a->s1, a->n1)) && find(e, v, p, true, &n));
 END
 
 COMMAND(bm, NOLOCATOR) /* set bookmark */
@@ -282,7 +1077,7 @@ COMMAND(cd, MARK) /* cursor down, same column */
 END
 
 COMMAND(ce, NOFLAGS) /* cursor to end of line */
-   v->p = pos(p.l, b->n? b->l[p.l].n : 0);
+   v->p = pos(p.l, b->n? lineat(b, p.l)->n : 0);
 END
 
 COMMAND(cf, NOLOCATOR) /* call a function key */
@@ -294,7 +1089,7 @@ END
 COMMAND(cj, NOFLAGS) /* cursor jump to EOL/BOL */
    if (!haslines)
       SUCCEED;
-   LINE *l = &b->l[p.l];
+   const LINE *l = lineat(b, p.l);
    v->p.c = (p.c == l->n)? 0 : l->n;
 END
 
@@ -343,21 +1138,18 @@ COMMAND(d, MARK | CLEARSBLOCK) /* delete line */
    if (!haslines)
       SUCCEED;
    free(v->dl);
-   v->dl = dupstr(b->l[p.l].s, b->l[p.l].n);
-   v->dln = b->l[p.l].n;
+   v->dl = duptext(b, pos(p.l, 0), &v->dln);
    if (!v->dl)
       ERROR("Out of memory");
    RETURN(deleteline(b, p.l));
 END
 
 COMMAND(db, MARK | NEEDSBLOCK | CLEARSBLOCK) /* delete block */
-    size_t n = v->be - v->bs;
-    for (size_t i = 0; i <= n && b->n; i++)
-        deleteline(b, v->bs);
+    RETURN(deletelines(b, v->bs, v->be < b->n? v->be : b->n - 1) || error(e, "Out of memory"));
 END
 
 COMMAND(dc, NOFLAGS | NEEDSLINES) /* delete character at cursor */
-   if (b->n && p.c < b->l[p.l].n && b->l[p.l].n)
+   if (b->n && p.c < lineat(b, p.l)->n)
       RETURN(deletetext(b, p, 1));
 END
 
@@ -386,7 +1178,7 @@ COMMAND(dl, NOFLAGS) /* delete character to left */
    if (!p.c)
       ERROR("Beginning of line");
    v->p.c--;
-   if (haslines && v->p.c < b->l[v->p.l].n)
+   if (haslines && v->p.c < lineat(b, v->p.l)->n)
       RETURN(deletetext(b, v->p, 1));
 END
 
@@ -438,12 +1230,12 @@ COMMAND(dw, MARK) /* delete to end of current word */
    RETURN(deletetext(b, v->p, n));
 END
 
-COMMAND(e, MARK | NOLOCATOR) /* exchange s/t */
+COMMAND(e, MARK | NOLOCATOR | WHOLEFILE) /* exchange s/t */
    RETURN(exchange(e, v, a, false));
 END
 
 COMMAND(el, MARK) /* delete to EOL */
-   RETURN(!haslines || p.c >= b->l[p.l].n || deletetext(b, p, b->l[p.l].n - p.c));
+   RETURN(!haslines || p.c >= lineat(b, p.l)->n || deletetext(b, p, lineat(b, p.l)->n - p.c));
 END
 
 COMMAND(ep, MARK | NOLOCATOR) /* go to beginning or end of page */
@@ -455,14 +1247,14 @@ COMMAND(ep, MARK | NOLOCATOR) /* go to beginning or end of page */
    lineno n = v->tos.l + lines - 1;
    if (v->tos.l + lines - 1 >= b->n)
        n = b->n - 1;
-   LINE *l = &b->l[n];
+   const LINE *l = lineat(b, n);
    if (p.l != v->tos.l || p.c > v->tos.c)
        v->p = v->tos;
    else
        v->p = pos(n, l->n);
 END
 
-COMMAND(eq, MARK | NOLOCATOR) /* exchange with query */
+COMMAND(eq, MARK | NOLOCATOR | WHOLEFILE) /* exchange with query */
    RETURN(exchange(e, v, a, true));
 END
 
@@ -474,8 +1266,9 @@ COMMAND(ex, NOLOCATOR) /* expand margins */
    v->ex = true;
 END
 
-COMMAND(f, MARK | SETSHILITE | NOLOCATOR) /* find forward */
-    RETURN((!a->n1 || setfind(e, a->s1, a->n1)) && find(e, v, p, false));
+COMMAND(f, MARK | SETSHILITE | NOLOCATOR | WHOLEFILE) /* find forward */
+    size_t n;
+    RETURN((!a->n1 || setfind(e, a->s1, a->n1)) && find(e, v, p, false, &n));
 END
 
 COMMAND(fb, MARK | NEEDSBLOCK | CLEARSBLOCK) /* filter block through command */
@@ -512,7 +1305,13 @@ COMMAND(fb, MARK | NEEDSBLOCK | CLEARSBLOCK) /* filter block through command */
    } else{
       free(s);
       close(tochild[0]);
-      writelines(tochild[1], e, v->b, v->bs, v->be);
+      char *o = malloc(WRITE_MAX);
+      if (!o)
+         error(e, "Out of memory");
+      else if (!writelines(tochild[1], bufferline, v->b, v->bs, v->be, o))
+         error(e, strerror(errno));
+      free(o);
+      close(tochild[1]);
       while (waitpid(pid, NULL, WNOHANG) == 0){
          if (getkeystroke(e, false).o != ERR){
             kill(pid, SIGKILL);
@@ -521,7 +1320,6 @@ COMMAND(fb, MARK | NEEDSBLOCK | CLEARSBLOCK) /* filter block through command */
       }
    }
    close(tfd);
-   close(tochild[1]);
 
    wchar_t *ws = stows(tfn, sizeof(tfn) - 1);
    if (!ws){
@@ -539,11 +1337,15 @@ COMMAND(fc, NOFLAGS) /* flip case */
    wchar_t w = charat(b, p);
    bool r = true;
    w = iswupper(w)? towlower(w) : towupper(w);
-   if (haslines && p.c < b->l[p.l].n)
+   if (haslines && p.c < lineat(b, p.l)->n)
       r = deletetext(b, p, 1) && inserttext(b, p, &w, 1);
    RETURN(r && cmd_cr(e, v, a));
 END
 
+COMMAND(fo, NOLOCATOR) /* follow the file as it grows */
+    RETURN(startfollow(e));
+END
+
 COMMAND(gb, MARK | NOLOCATOR) /* go back to previous position */
    if (v->gb.l == NONE || v->gb.l >= b->n)
       ERROR("No previous position");
@@ -567,45 +1369,840 @@ COMMAND(ib, MARK | NEEDSBLOCK) /* insert block */
     if (p.l >= v->bs && p.l <= v->be)
         ERROR("Cursor inside block");
 
-    size_t n = v->be - v->bs;
-    lineno bs = p.l < v->bs? v->bs + n + 1 : v->bs;
-    for (size_t i = 0; i <= n; i++){
-        if (!insertline(v->b, v->p.l))
-            FAIL;
-    }
-
-    for (size_t i = 0; i <= n; i++){
-        const LINE *l = &v->b->l[bs + i];
-        if (!inserttext(b, pos(p.l + i, 0), l->s, l->n))
-            FAIL;
-    }
+    size_t n = v->be - v->bs + 1;
+    lineno bs = p.l < v->bs? v->bs + n : v->bs;
+    LINE *x = calloc(n, sizeof(LINE));
+    if (!x)
+        ERROR("Out of memory");
+    for (size_t i = 0; i < n; i++)
+        x[i] = *lineat(b, v->bs + i);
+    bool r = insertlines(b, p.l, x, n);
+    free(x);
+    if (!r)
+        ERROR("Out of memory");
 
     v->bs = bs;
-    v->be = bs + n;
-END
+    v->be = bs + n - 1;
+END
+
+/* Lines read by IF are gathered into batches and handed to insertlines
+ * together, so that a file goes in with a handful of tree operations
+ * and a single undo record. They are kept undecoded until then, and are
+ * decoded straight into the buffer's storage.
+ */
+#define LOAD_MAX 1024
+typedef struct LOAD LOAD;
+struct LOAD{
+    BUFFER *b;
+    lineno l;
+    size_t n, tn, ta;
+    char *t; /* the undecoded text of the lines in x */
+    LINE x[LOAD_MAX];
+};
 
 static bool
-cmd_if_cb(const wchar_t *s, size_t n, void *p)
+flushload(LOAD *d)
 {
-    VIEW *v = (VIEW *)p;
-    v->p.c = 0;
-    bool rc = insertline(v->b, v->p.l) && inserttext(v->b, v->p, s, n);
-    v->p.l++;
+    size_t o = 0;
+    for (size_t i = 0; i < d->n; i++){
+        d->x[i] = byteline(d->t + o, d->x[i].n);
+        o += d->x[i].n;
+    }
+    bool rc = insertlines(d->b, d->l, d->x, d->n);
+    d->l += d->n;
+    d->n = d->tn = 0;
     return rc;
 }
 
+static bool
+cmd_if_cb(const char *s, size_t n, void *p)
+{
+    LOAD *d = (LOAD *)p;
+    if (d->tn + n > d->ta){
+        size_t a = d->ta? d->ta : 4096;
+        while (a < d->tn + n)
+            a *= 2;
+        char *t = realloc(d->t, a);
+        if (!t)
+            return false;
+        d->t = t;
+        d->ta = a;
+    }
+    memcpy(d->t + d->tn, s, n);
+    d->tn += n;
+    d->x[d->n++].n = n;
+    return d->n < LOAD_MAX || flushload(d);
+}
+
+static bool
+readinto(EDITOR *e, BUFFER *b, lineno l, const char *fn)
+{
+    LOAD *d = calloc(1, sizeof(LOAD));
+    if (!d)
+        return error(e, "Out of memory");
+    d->b = b;
+    d->l = l;
+    bool r = readfile(fn, cmd_if_cb, d);
+    if (!r)
+      snprintf(e->err, ERR_MAX, "Could not open file: %s", strerror(errno));
+    if (!flushload(d) && r)
+      r = error(e, "Out of memory");
+    free(d->t);
+    free(d);
+    return r;
+}
+
 COMMAND(if, MARK | CLEARSBLOCK) /* insert file */
     char *fn = wstos(a->s1, a->n1);
     if (!fn)
         ERROR("Out of memory");
-    bool r = readfile(fn, cmd_if_cb, v);
-    if (!r)
-      snprintf(e->err, ERR_MAX, "Could not open file: %s", strerror(errno));
+
+    /* regular files are mapped and their lines decoded as they are used */
+    struct stat st;
+    size_t n = 0;
+    char *m = mapfile(fn, &n, &st);
+    bool r = m? insertmapped(b, p.l, m, n, &st) || error(e, "Out of memory")
+              : readinto(e, b, p.l, fn);
     v->p = p;
     free(fn);
     RETURN(r);
 END
 
+/* Following the file named at startup adds what is written to the end
+ * of it to the end of the buffer as it comes, as tail -f does. Rather
+ * than being watched, which can't be done the same way everywhere, the
+ * file is looked at each tick: when it has grown what is new is read,
+ * and the complete lines in it are added as lines of the file being
+ * loaded are, while the rest waits for its newline. A file that has
+ * shrunk has been cut short and is read again from the start, and
+ * another file under its name means it has been rotated, so the rest
+ * of the old one is read and then the new one from the start. The
+ * buffer's mapping of the file is copied aside first, since the lines
+ * in it would be lost with the file's text if it were cut short.
+ */
+#define FOLLOW_READ  (1 << 20) /* bytes read at a time */
+#define FOLLOW_MAX   (1 << 24) /* bytes read in a tick */
+#define FOLLOW_LINES 1024
+struct FOLLOW{
+    int fd;      /* the file, or -1 when it isn't being followed */
+    dev_t dev;
+    ino_t ino;
+    off_t o;     /* how much of it has been read */
+    bool cut;    /* the buffer's last line waits for the rest of it */
+    char *s;     /* what has been read since the last newline */
+    size_t n, a;
+};
+
+/* Remember that the file st has been read up to o. */
+static bool
+readto(EDITOR *e, const struct stat *st, off_t o, bool cut)
+{
+    FOLLOW *f = e->follow;
+    if (!f){
+        if (!(f = e->follow = calloc(1, sizeof(FOLLOW))))
+            return false;
+        f->fd = -1;
+    }
+    f->dev = st->st_dev;
+    f->ino = st->st_ino;
+    f->o = o;
+    f->cut = cut;
+    return true;
+}
+
+/* Add the lines that have been read to the buffer, and what follows the
+ * last of them too if asked.
+ */
+static bool
+takelines(EDITOR *e, FOLLOW *f, bool all)
+{
+    BUFFER *b = e->docview.b;
+    LINE x[FOLLOW_LINES];
+    size_t k = 0;
+    const char *p = f->s, *end = f->s + f->n, *nl = NULL;
+    bool rc = true;
+    if (f->cut && p < end && ((nl = memchr(p, '\n', end - p)) || all)){
+        rc = appendtext(b, p, (nl? nl : end) - p);
+        p = nl? nl + 1 : end;
+        f->cut = false;
+    }
+    while (rc && p < end && ((nl = memchr(p, '\n', end - p)) || all)){
+        x[k++] = byteline(p, (nl? nl : end) - p);
+        p = nl? nl + 1 : end;
+        if (k == FOLLOW_LINES){
+            rc = appendlines(b, x, k, false);
+            k = 0;
+        }
+    }
+    if (rc && k)
+        rc = appendlines(b, x, k, false);
+    f->n = end - p;
+    memmove(f->s, p, f->n);
+    return rc;
+}
+
+/* Read the file up to end, or as much of it as is read in a tick. */
+static bool
+readmore(EDITOR *e, FOLLOW *f, off_t end)
+{
+    for (size_t got = 0; f->o < end && got < FOLLOW_MAX; ){
+        if (f->a - f->n < FOLLOW_READ){
+            size_t a = f->a? f->a * 2 : FOLLOW_READ;
+            char *s = realloc(f->s, a);
+            if (!s)
+                return false;
+            f->s = s;
+            f->a = a;
+        }
+
+        size_t n = end - f->o < FOLLOW_READ? (size_t)(end - f->o) : FOLLOW_READ;
+        ssize_t r = pread(f->fd, f->s + f->n, n, f->o);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return r == 0;
+        f->o += r;
+        f->n += r;
+        got += r;
+        if (!takelines(e, f, false))
+            return false;
+    }
+    return true;
+}
+
+bool
+following(const EDITOR *e)
+{
+    return e->follow && e->follow->fd >= 0;
+}
+
+bool
+startfollow(EDITOR *e)
+{
+    finishload(e, false);
+    if (following(e))
+        return true;
+
+    struct stat st;
+    if (stat(e->name, &st) != 0 || (st.st_mode & S_IFMT) != S_IFREG)
+        return error(e, "Not a regular file");
+    int fd = open(e->name, O_RDONLY);
+    if (fd < 0)
+        return error(e, "Could not open file");
+    if (fstat(fd, &st) != 0)
+        return close(fd), error(e, "Could not open file");
+
+    /* without a record of how much of the file was read, the buffer is
+     * taken to hold what there is of it so far
+     */
+    FOLLOW *f = e->follow;
+    bool rc = true;
+    if (!f)
+        rc = readto(e, &st, e->docview.b->n? st.st_size : 0, false);
+    else if (f->dev != st.st_dev || f->ino != st.st_ino)
+        rc = takelines(e, f, true) && readto(e, &st, 0, false);
+    if (!rc)
+        return close(fd), error(e, "Out of memory");
+    if (!detach(e->docview.b, &st))
+        return close(fd), error(e, "Could not copy file");
+    e->follow->fd = fd;
+    return true;
+}
+
+/* Stop following the file, and forget how much of it was read if asked. */
+void
+stopfollow(EDITOR *e, bool forget)
+{
+    FOLLOW *f = e->follow;
+    if (!f)
+        return;
+    if (f->fd >= 0)
+        close(f->fd);
+    f->fd = -1;
+    if (forget){
+        free(f->s);
+        free(f);
+        e->follow = NULL;
+    }
+}
+
+/* Add what has been written to the followed file since it was last
+ * looked at. Returns whether the buffer changed.
+ */
+bool
+pollfollow(EDITOR *e)
+{
+    if (!following(e))
+        return false;
+
+    FOLLOW *f = e->follow;
+    struct stat st, now;
+    off_t o = f->o;
+    bool rc = fstat(f->fd, &st) == 0, changed = false;
+    if (rc && st.st_size < f->o){
+        f->o = 0;
+        f->n = 0;
+        f->cut = false;
+        error(e, "File was cut short");
+        changed = true;
+    }
+    rc = rc && detach(e->docview.b, &st) && readmore(e, f, st.st_size);
+
+    if (rc && f->o >= st.st_size && stat(e->name, &now) == 0
+    &&  (now.st_mode & S_IFMT) == S_IFREG && (now.st_dev != f->dev || now.st_ino != f->ino)){
+        int fd = open(e->name, O_RDONLY);
+        if (fd >= 0 && fstat(fd, &now) == 0 && (rc = takelines(e, f, true))){
+            close(f->fd);
+            readto(e, &now, 0, false);
+            f->fd = fd;
+            error(e, "File was replaced");
+            changed = true;
+        } else if (fd >= 0)
+            close(fd);
+    }
+    if (!rc){
+        stopfollow(e, false);
+        error(e, "Could not follow file");
+    } else if (f->o == st.st_size && !f->n)
+        e->disk = st;
+    return changed || f->o != o;
+}
+
+/* When the file changes on disk, the text is brought back into line with
+ * it by editing only the lines that differ, as one change that can be
+ * undone. The new file is mapped and walked in step with a snapshot of
+ * the text, comparing bytes, and lines of the text that haven't changed
+ * since they were read are compared where they lie, so lines that are
+ * the same cost no more than that; only those that differ are journaled,
+ * or decoded if they are used. Where a line differs, lines on each side
+ * are hashed, more of them each time up to RELOAD_WINDOW, until the
+ * nearest place with RELOAD_SYNC lines alike on both is found. What
+ * comes before it is a hunk, whose lines in the text are deleted and
+ * replaced by the file's, mapped as those of IF are. When nothing alike
+ * is that near, the whole window is a hunk.
+ */
+#define RELOAD_FIRST  64
+#define RELOAD_WINDOW 4096
+#define RELOAD_SYNC   3
+typedef struct{
+    SNAPSHOT *s;
+    lineno n;       /* the text's lines */
+    const char *e;  /* the end of the file */
+    const char **w; /* where the file's lines in the window start */
+    uint64_t *h;    /* and their hashes */
+    size_t *slot;   /* and which they are by hash */
+    char *t;        /* for encoding lines of the text */
+    size_t ta;
+} RELOAD;
+
+static uint64_t
+hashbytes(const char *s, size_t n)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < n; i++)
+        h = (h ^ (unsigned char)s[i]) * 1099511628211ull;
+    return h;
+}
+
+/* The bytes of the text's line l, as read or as they would be saved. */
+static const char *
+oldline(RELOAD *r, lineno l, size_t *n)
+{
+    const LINE *x = snapraw(r->s, l);
+    const char *m = x? linebytes(x) : NULL;
+    if (m)
+        return *n = x->n, m;
+    if (!x || !(x = snapline(r->s, l)))
+        return NULL;
+    if (x->n * MB_CUR_MAX > r->ta){
+        char *t = realloc(r->t, x->n * MB_CUR_MAX);
+        if (!t)
+            return NULL;
+        r->t = t;
+        r->ta = x->n * MB_CUR_MAX;
+    }
+    *n = encodeline(x, 0, x->n, r->t) - r->t;
+    return r->t;
+}
+
+/* Where the file's line at q ends, and the next begins. */
+static const char *
+lineend(const RELOAD *r, const char *q, const char **next)
+{
+    const char *nl = memchr(q, '\n', r->e - q);
+    *next = nl? nl + 1 : r->e;
+    return nl? nl : r->e;
+}
+
+/* Whether k lines of the text from l are the same as the file's from q,
+ * or as many as there are if both end first; -1 if it can't be told.
+ */
+static int
+alike(RELOAD *r, lineno l, const char *q, size_t k)
+{
+    for (size_t i = 0; i < k; i++, l++){
+        if (l >= r->n || q >= r->e)
+            return l >= r->n && q >= r->e;
+        size_t n;
+        const char *m = oldline(r, l, &n), *s = q, *end = lineend(r, q, &q);
+        if (!m)
+            return -1;
+        if (n != (size_t)(end - s) || memcmp(m, s, n) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+/* Find how many lines of the text from l and of the file from q, which
+ * differ, come before they are alike again.
+ */
+static bool
+resync(RELOAD *r, lineno l, const char *q, size_t *a, size_t *c)
+{
+    for (size_t w = RELOAD_FIRST; ; w *= 2){
+        size_t na = r->n - l < w? r->n - l : w, nc = 0, mask = 2 * w - 1;
+        memset(r->slot, 0, 2 * w * sizeof(size_t));
+        for (r->w[0] = q; nc < w && r->w[nc] < r->e; nc++){
+            const char *s = r->w[nc];
+            uint64_t h = r->h[nc] = hashbytes(s, lineend(r, s, r->w + nc + 1) - s);
+            size_t k = h & mask;
+            while (r->slot[k] && r->h[r->slot[k] - 1] != h)
+                k = (k + 1) & mask;
+            if (!r->slot[k])
+                r->slot[k] = nc + 1;
+        }
+
+        size_t best = SIZE_MAX;
+        for (size_t i = 0; i < na && i < best; i++){
+            size_t n, k;
+            const char *m = oldline(r, l + i, &n);
+            if (!m)
+                return false;
+            uint64_t h = hashbytes(m, n);
+            for (k = h & mask; r->slot[k] && r->h[r->slot[k] - 1] != h; )
+                k = (k + 1) & mask;
+            size_t j = r->slot[k] - 1;
+            if (!r->slot[k] || i + j >= best)
+                continue;
+            int y = alike(r, l + i, r->w[j], RELOAD_SYNC);
+            if (y < 0)
+                return false;
+            if (y){
+                best = i + j;
+                *a = i;
+                *c = j;
+            }
+        }
+        if (best != SIZE_MAX)
+            return true;
+        if (w >= RELOAD_WINDOW || (na == r->n - l && r->w[nc] == r->e)){
+            *a = na;
+            *c = nc;
+            return true;
+        }
+    }
+}
+
+/* A file written over in place, rather than replaced, takes the text
+ * mapped from it along: what was read is gone, and the lines compared
+ * are what is now at the same places in it. They still come out as the
+ * file is, but they can't be put back, so nothing before the reload can
+ * be undone and *undoable says so.
+ */
+static bool
+reload(EDITOR *e, bool *undoable)
+{
+    BUFFER *b = e->docview.b;
+    struct stat st;
+    size_t n = 0;
+    char *m = mapfile(e->name, &n, &st);
+    if (!m && (stat(e->name, &st) != 0 || (st.st_mode & S_IFMT) != S_IFREG || st.st_size))
+        return error(e, "Could not open file");
+    *undoable = !isbacking(b, &st);
+
+    RELOAD r = {.e = m? m + n : NULL};
+    r.w = malloc((RELOAD_WINDOW + 1) * sizeof(const char *));
+    r.h = malloc(RELOAD_WINDOW * sizeof(uint64_t));
+    r.slot = malloc(2 * RELOAD_WINDOW * sizeof(size_t));
+    bool rc = r.w && r.h && r.slot && (!m || addsource(b, m, n, &st));
+    bool mapped = rc && m, inserted = false;
+    if (!rc && m)
+        munmap(m, n);
+    stopcount(e, false);
+    rc = rc && (r.s = takesnapshot(b)) != NULL;
+    r.n = b->n;
+
+    const char *q = m;
+    for (lineno o = 0, l = 0; rc && (o < r.n || q < r.e); ){
+        int y = o < r.n && q < r.e? alike(&r, o, q, 1) : 0;
+        if (y > 0){
+            lineend(&r, q, &q);
+            o++, l++;
+            continue;
+        }
+
+        size_t a = r.n - o, c = 0;
+        const char *to = r.e;
+        if (y < 0)
+            rc = false;
+        else if (o < r.n && q < r.e && (rc = resync(&r, o, q, &a, &c)))
+            to = r.w[c];
+        if (rc && a)
+            rc = deletelines(b, l, l + a - 1);
+        if (rc && to > q)
+            rc = inserted = insertbytes(b, l, q, to - q);
+        o += a;
+        l += c;
+        q = to;
+    }
+
+    dropsnapshot(r.s);
+    if (mapped && !inserted)
+        dropsource(b, m);
+    free(r.w);
+    free(r.h);
+    free(r.slot);
+    free(r.t);
+    if (!rc)
+        return error(e, "Out of memory");
+    if (!*undoable){
+        clearundo(b);
+        mapcut(); /* the text it found cut short has been replaced */
+    }
+    b->dirty = false;
+    e->disk = st;
+    return true;
+}
+
+/* Notice the file named at startup being changed by something else, and
+ * reload it unless the text has been changed since it was read. Returns
+ * whether the text was reloaded.
+ */
+bool
+pollchange(EDITOR *e)
+{
+    struct stat st, *d = &e->disk;
+    if (e->reader || e->save || following(e) || e->held || e->focusview != &e->docview
+    ||  (d->st_mode & S_IFMT) != S_IFREG
+    ||  stat(e->name, &st) != 0 || (st.st_mode & S_IFMT) != S_IFREG)
+        return false;
+    if (st.st_dev == d->st_dev && st.st_ino == d->st_ino
+    &&  st.st_size == d->st_size && st.st_mtime == d->st_mtime)
+        return false;
+
+    if (e->docview.b->dirty){
+        *d = st;
+        return error(e, "File changed on disk; RL reloads it");
+    }
+    bool undoable;
+    mark(e->docview.b);
+    if (reload(e, &undoable))
+        error(e, undoable? "File reloaded" : "File written over in place; reloaded without undo");
+    else
+        *d = st;
+    fixcursor(e);
+    return true;
+}
+
+/* The file named at startup is read in the background and split into
+ * batches of lines that are added to the end of the buffer as they
+ * arrive, so that it can be shown and moved about in before all of it
+ * has been read. Since lines only ever go on the end, edits made in the
+ * meantime are unaffected by them.
+ *
+ * A mapped file is cut into parts, each split into lines by a thread of
+ * its own, and the parts' batches are taken in order. A part runs from
+ * just after the first newline at or before its nominal start to just
+ * after the first one before its nominal end, so that each worker can
+ * find its own bounds. Only UTF-8 is known to be safe to cut at any
+ * newline byte, so in other locales one thread does all of it, as it
+ * does for pipes, which can only be read in order.
+ */
+#define READ_BATCH 16384     /* lines */
+#define READ_STEP  64        /* batches taken at a time */
+#define READ_PART  (1 << 24) /* the least worth a thread of its own */
+#define READ_PARTS 32
+typedef struct BATCH BATCH;
+struct BATCH{
+    BATCH *next;
+    size_t n, tn, ta;
+    char *t; /* the text of lines that aren't mapped */
+    LINE x[READ_BATCH];
+};
+
+typedef struct PART PART;
+struct PART{
+    READER *r;
+    pthread_t t;
+    size_t k;
+    BATCH *cur;
+
+    /* shared with the thread, under r->m */
+    BATCH *head, **tail;
+    bool finished, ok;
+    int err;
+};
+
+struct READER{
+    pthread_mutex_t m;
+    pthread_cond_t c;
+    BUFFER *b;
+    char *fn, *map;
+    size_t mn;
+    PART *w;
+    size_t nw, next; /* parts, and the one being taken from */
+    bool cancel;     /* under m */
+};
+
+static void
+freebatches(BATCH *t)
+{
+    while (t){
+        BATCH *n = t->next;
+        free(t->t);
+        free(t);
+        t = n;
+    }
+}
+
+/* Hand t over to the editor; false if it is no longer wanted. */
+static bool
+queuebatch(PART *w, BATCH *t)
+{
+    size_t o = 0;
+    for (size_t i = 0; t->t && i < t->n; i++){
+        t->x[i] = byteline(t->t + o, t->x[i].n);
+        o += t->x[i].n;
+    }
+
+    pthread_mutex_lock(&w->r->m);
+    bool rc = !w->r->cancel;
+    if (rc && t->n){
+        *w->tail = t;
+        w->tail = &t->next;
+        pthread_cond_signal(&w->r->c);
+    } else
+        freebatches(t);
+    pthread_mutex_unlock(&w->r->m);
+    return rc;
+}
+
+static bool
+gatherline(const char *s, size_t n, void *p)
+{
+    PART *w = p;
+    BATCH *t = w->cur;
+    if (!t && !(t = w->cur = calloc(1, sizeof(BATCH))))
+        return false;
+    if (t->tn + n > t->ta){
+        size_t a = t->ta? t->ta : 4096;
+        while (a < t->tn + n)
+            a *= 2;
+        char *x = realloc(t->t, a);
+        if (!x)
+            return false;
+        t->t = x;
+        t->ta = a;
+    }
+    memcpy(t->t + t->tn, s, n);
+    t->tn += n;
+    t->x[t->n++].n = n;
+    if (t->n < READ_BATCH)
+        return true;
+    w->cur = NULL;
+    return queuebatch(w, t);
+}
+
+/* Where part k of the mapped file begins. */
+static const char *
+partstart(const READER *r, size_t k)
+{
+    size_t o = r->mn / r->nw * k;
+    if (!k || k >= r->nw)
+        return r->map + (k? r->mn : 0);
+    const char *nl = memchr(r->map + o - 1, '\n', r->mn - o + 1);
+    return nl? nl + 1 : r->map + r->mn;
+}
+
+static void *
+readthread(void *p)
+{
+    PART *w = p;
+    READER *r = w->r;
+    bool rc = true;
+    if (r->map){
+        const char *s = partstart(r, w->k), *e = partstart(r, w->k + 1);
+        while (rc && s < e){
+            BATCH *t = calloc(1, sizeof(BATCH));
+            if (!t){
+                rc = false;
+                break;
+            }
+            for (; t->n < READ_BATCH && s < e; t->n++){
+                const char *nl = memchr(s, '\n', e - s);
+                if (!nl)
+                    nl = e;
+                t->x[t->n] = byteline(s, nl - s);
+                s = nl + 1;
+            }
+            rc = queuebatch(w, t);
+        }
+    } else if ((rc = readfile(r->fn, gatherline, w)) && w->cur){
+        rc = queuebatch(w, w->cur);
+        w->cur = NULL;
+    }
+    int err = errno;
+
+    pthread_mutex_lock(&r->m);
+    w->finished = true;
+    w->ok = rc;
+    w->err = err;
+    pthread_cond_signal(&r->c);
+    pthread_mutex_unlock(&r->m);
+    return NULL;
+}
+
+/* Stop the reader's threads and let it go. A thread reading from a pipe
+ * may be waiting for input that will never come, so it is cancelled as
+ * well as told to stop.
+ */
+static void
+closereader(READER *r)
+{
+    pthread_mutex_lock(&r->m);
+    r->cancel = true;
+    pthread_mutex_unlock(&r->m);
+    for (size_t i = 0; i < r->nw; i++){
+        if (!r->map)
+            pthread_cancel(r->w[i].t);
+        pthread_join(r->w[i].t, NULL);
+        freebatches(r->w[i].cur);
+        freebatches(r->w[i].head);
+    }
+    pthread_cond_destroy(&r->c);
+    pthread_mutex_destroy(&r->m);
+    free(r->w);
+    free(r->fn);
+    free(r);
+}
+
+/* Start reading fn into the document. */
+bool
+startload(EDITOR *e, const char *fn)
+{
+    READER *r = calloc(1, sizeof(READER));
+    if (!r || !(r->fn = strdup(fn)))
+        return free(r), error(e, "Out of memory");
+
+    struct stat st;
+    r->b = e->docview.b;
+    if ((r->map = mapfile(fn, &r->mn, &st)) && !addsource(r->b, r->map, r->mn, &st)){
+        munmap(r->map, r->mn);
+        r->map = NULL;
+    }
+    if (r->map || (stat(fn, &st) == 0 && (st.st_mode & S_IFMT) == S_IFREG)){
+        e->disk = st;
+        readto(e, &st, r->map? (off_t)r->mn : st.st_size, r->map && r->map[r->mn - 1] != '\n');
+    }
+
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    r->nw = 1;
+    if (r->map && isutf8() && n > 1)
+        r->nw = (size_t)n < r->mn / READ_PART? (size_t)n : r->mn / READ_PART;
+    if (r->nw > READ_PARTS)
+        r->nw = READ_PARTS;
+    if (!r->nw)
+        r->nw = 1;
+    if (!(r->w = calloc(r->nw, sizeof(PART))))
+        return free(r->fn), free(r), error(e, "Out of memory");
+    if (pthread_mutex_init(&r->m, NULL) != 0)
+        return free(r->w), free(r->fn), free(r), error(e, "Out of memory");
+    if (pthread_cond_init(&r->c, NULL) != 0){
+        pthread_mutex_destroy(&r->m);
+        return free(r->w), free(r->fn), free(r), error(e, "Out of memory");
+    }
+
+    size_t k = 0;
+    for (; k < r->nw; k++){
+        PART *w = r->w + k;
+        w->r = r;
+        w->k = k;
+        w->tail = &w->head;
+        if (pthread_create(&w->t, NULL, readthread, w) != 0)
+            break;
+    }
+    if (k < r->nw){
+        r->nw = k;
+        closereader(r);
+        return error(e, "Could not start reading file");
+    }
+    e->reader = r;
+    if (r->map)
+        pollload(e, true); /* the first lines of a mapped file come at once */
+    return true;
+}
+
+/* Add what has been read to the buffer, waiting for some if asked, and
+ * notice when the reading is done. Returns whether any lines were added.
+ */
+bool
+pollload(EDITOR *e, bool wait)
+{
+    READER *r = e->reader;
+    if (!r)
+        return false;
+    PART *w = r->w + r->next;
+    pthread_mutex_lock(&r->m);
+    while (wait && !w->head && !w->finished)
+        pthread_cond_wait(&r->c, &r->m);
+    BATCH *t = w->head, **n = &w->head;
+    for (size_t i = 0; *n && i < READ_STEP; i++)
+        n = &(*n)->next;
+    w->head = *n;
+    *n = NULL;
+    if (!w->head)
+        w->tail = &w->head;
+    bool finished = w->finished && !w->head;
+    pthread_mutex_unlock(&r->m);
+
+    bool added = t != NULL, rc = true;
+    for (BATCH *x = t; rc && x; x = x->next)
+        rc = appendlines(r->b, x->x, x->n, r->map != NULL);
+    freebatches(t);
+    if (!rc || (finished && !w->ok)){
+        if (rc)
+            snprintf(e->err, ERR_MAX, "Could not open file: %s", strerror(w->err));
+        else
+            error(e, "Out of memory");
+        closereader(r);
+        e->reader = NULL;
+    } else if (finished && ++r->next == r->nw){
+        closereader(r);
+        e->reader = NULL;
+    }
+    return added;
+}
+
+/* Wait until line l has been read, or all of the file has. */
+static void
+loadthrough(EDITOR *e, lineno l)
+{
+    while (e->reader && e->reader->b->n <= l)
+        pollload(e, true);
+}
+
+/* Read the rest of the file, or give up on it. */
+void
+finishload(EDITOR *e, bool cancel)
+{
+    if (e->reader && cancel){
+        closereader(e->reader);
+        e->reader = NULL;
+    }
+    while (e->reader)
+        pollload(e, true);
+}
+
 COMMAND(im, NOLOCATOR) /* ignore (don't show) matching braces */
    v->sm = false;
 END
@@ -626,10 +2223,8 @@ squeezespace(BUFFER *b, POS p)
 COMMAND(j, MARK | CLEARSBLOCK) /* join this line and next */
     if (b->n < 2 || p.l >= b->n - 1)
         ERROR("End of file");
-    LINE *l1 = &b->l[p.l];
-    LINE *l2 = &b->l[p.l + 1];
-    POS np = pos(p.l, l1->n);
-    RETURN(inserttext(b, pos(p.l, l1->n), l2->s, l2->n) && deleteline(b, p.l + 1) && squeezespace(b, np));
+    POS np = pos(p.l, lineat(b, p.l)->n);
+    RETURN(copytext(b, np, pos(p.l + 1, 0), lineat(b, p.l + 1)->n) && deleteline(b, p.l + 1) && squeezespace(b, np));
 END
 
 COMMAND(lc, NOLOCATOR) /* case-sensitive searching */
@@ -637,11 +2232,27 @@ COMMAND(lc, NOLOCATOR) /* case-sensitive searching */
 END
 
 COMMAND(m, MARK | NOLOCATOR) /* move to line */
+    if (a->n1 != NONE && a->n1)
+        loadthrough(e, a->n1 - 1);
     if (a->n1 == NONE || a->n1 == 0 || a->n1 - 1 >= b->n || !b->n)
       ERROR("Invalid line");
     v->p.l = a->n1 - 1;
 END
 
+COMMAND(mo, MARK | NOLOCATOR | WHOLEFILE) /* move to byte offset */
+    if (a->n1 == NONE || a->n1 >= textsize(b, NULL))
+      ERROR("Invalid offset");
+    v->p = bytepos(b, a->n1);
+END
+
+COMMAND(mp, MARK | NOLOCATOR) /* move to percentage of file */
+    if (a->n1 == NONE || a->n1 > 100)
+      ERROR("Invalid percentage");
+    finishload(e, false);
+    size_t n = textsize(b, NULL);
+    v->p = bytepos(b, n / 100 * a->n1 + n % 100 * a->n1 / 100);
+END
+
 COMMAND(mc, NOLOCATOR) /* remap control key */
    if (a->n1 != 1 || a->n2 != 1 || !a->s1 || !a->s2)
       ERROR("Invalid mapping specification");
@@ -662,10 +2273,18 @@ COMMAND(n, MARK) /* move to beginning of next line */
    v->p = pos(p.l + 1, 0);
 END
 
+COMMAND(nf, NOLOCATOR) /* don't follow the file */
+    stopfollow(e, false);
+END
+
 COMMAND(ni, NOLOCATOR) /* regular indent */
    v->ai = false;
 END
 
+COMMAND(nx, NOLOCATOR) /* literal searching */
+    v->re = false;
+END
+
 COMMAND(p, MARK) /* move to beginning of previous line */
    if (!haslines || !p.l)
       ERROR("End of file");
@@ -673,6 +2292,7 @@ COMMAND(p, MARK) /* move to beginning of previous line */
 END
 
 COMMAND(pd, NOLOCATOR | MARK) /* page down */
+   loadthrough(e, p.l + v->ph);
    if (b->n < v->ph || b->n - v->tos.l <= v->ph || b->n - p.l <= v->ph)
       ERROR("End of file");
    v->tos.l += v->ph;
@@ -693,6 +2313,7 @@ COMMAND(pu, NOLOCATOR | MARK) /* page up */
 END
 
 COMMAND(q, NOLOCATOR) /* quit without save */
+    finishsave(e, true);
     if (e->docview.b->dirty && !prompt(e, "File has changed. Lose changes?"))
         FAIL;
     e->running = false;
@@ -725,11 +2346,12 @@ iscomment(const wchar_t *s, size_t n)
 }
 
 static bool
-cmd_rf_cb(const wchar_t *s, size_t n, void *p)
+cmd_rf_cb(const char *s, size_t n, void *p)
 {
-   if (!n || iscomment(s, n))
-      return true;
-   return runextended(s, n, (EDITOR *)p);
+   wchar_t *w = n? stows(s, n) : NULL;
+   bool rc = !n || (w && (iscomment(w, wcslen(w)) || runextended(w, wcslen(w), (EDITOR *)p)));
+   free(w);
+   return rc;
 }
 
 COMMAND(rf, NOLOCATOR) /* run command file */
@@ -741,11 +2363,25 @@ COMMAND(rf, NOLOCATOR) /* run command file */
     RETURN(r);
 END
 
+COMMAND(rl, MARK | NOLOCATOR) /* reload the file */
+    finishload(e, false);
+    finishsave(e, true);
+    bool undoable;
+    if (!reload(e, &undoable))
+        RETURN(false);
+    if (!undoable)
+        error(e, "File written over in place; reloaded without undo");
+END
+
 COMMAND(rm, NOLOCATOR) /* reset margins */
     v->rm = NONE;
     v->lm = 0;
 END
 
+COMMAND(rx, NOLOCATOR) /* regular expression searching */
+    v->re = true;
+END
+
 static bool
 runcommand(EDITOR *e, VIEW *v, const ARG *a, bool stay)
 {
@@ -753,8 +2389,11 @@ runcommand(EDITOR *e, VIEW *v, const ARG *a, bool stay)
         return error(e, "Commands abandoned");
     e->err[0] = 0;
     bool rc = true;
-    if (trimlength(&v->b->l[v->p.l])){
-        rc = runextended(v->b->l[v->p.l].s, v->b->l[v->p.l].n, e);
+    if (trimlength(lineat(v->b, v->p.l))){
+        size_t n;
+        wchar_t *s = duptext(v->b, pos(v->p.l, 0), &n);
+        rc = s? runextended(s, n, e) : error(e, "Out of memory");
+        free(s);
         e->lc = v->p;
         if (v->p.l == v->b->n - 1) /* only add a newline if we're not repeating */
             insertline(v->b, v->b->n);
@@ -791,18 +2430,18 @@ COMMAND(s, MARK | CLEARSBLOCK) /* split line */
 
     colno lm = v->lm == NONE? 0 : v->lm;
     if (v->ai && b->n && v->p.l){
-       const LINE *l = &b->l[v->p.l];
-       for (size_t i = 0; i < l->n; i++){
-          if (!iswspace(l->s[i])){
+       size_t n = lineat(b, v->p.l)->n;
+       for (size_t i = 0; i < n; i++){
+          if (!iswspace(charat(b, pos(v->p.l, i)))){
              lm = i;
              break;
           }
        }
     }
-    size_t ln = b->l[p.l].n;
+    size_t ln = lineat(b, p.l)->n;
     size_t n = p.c >= ln? 0 : ln - p.c;
     if (!insertline(v->b, p.l + 1)
-    ||  !inserttext(v->b, pos(p.l + 1, lm), b->l[p.l].s + p.c, n)
+    ||  !copytext(v->b, pos(p.l + 1, lm), p, n)
     ||  !deletetext(v->b, pos(p.l, p.c), n))
         ERROR("Out of memory");
     v->p = pos(p.l + 1, lm);
@@ -810,7 +2449,7 @@ COMMAND(s, MARK | CLEARSBLOCK) /* split line */
         v->tos.l++;
 END
 
-COMMAND(sa, NOLOCATOR) /* save text to file */
+COMMAND(sa, NOLOCATOR | WHOLEFILE) /* save text to file */
     char *fn = strdup(e->name);
     if (a->t == ARG_STRING && a->n1){
         free(fn);
@@ -819,14 +2458,7 @@ COMMAND(sa, NOLOCATOR) /* save text to file */
     if (!fn)
         ERROR("Out of memory");
 
-    int fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (fd < 0){
-       free(fn);
-       ERROR("Could not open file");
-    }
-    bool r = writelines(fd, e, b, 0, b->n? b->n - 1 : 0);
-    if (rc)
-        e->docview.b->dirty = false;
+    bool r = startsave(e, b, fn, 0, b->n, true);
     free(fn);
     RETURN(r);
 END
@@ -837,6 +2469,13 @@ COMMAND(sb, NOLOCATOR | MARK) /* show block on screen */
     v->p.l = v->bs;
 END
 
+COMMAND(sc, NOLOCATOR) /* set memory ceiling */
+   if (a->n1 > SIZE_MAX >> 20)
+      ERROR("Invalid ceiling");
+   e->docview.b->cap = a->n1 << 20;
+   e->docview.b->floor = 0;
+END
+
 COMMAND(sd, NOLOCATOR) /* set show matching bracket delay */
    if (a->n1 > 2000)
       ERROR("Invalid delay value");
@@ -860,6 +2499,16 @@ COMMAND(sf, NOLOCATOR) /* set function key */
         ERROR("Out of memory");
 END
 
+static char *
+linetos(const BUFFER *b, lineno l)
+{
+    size_t n;
+    wchar_t *t = duptext(b, pos(l, 0), &n);
+    char *s = t? wstos(t, n) : NULL;
+    free(t);
+    return s;
+}
+
 COMMAND(sh, NOLOCATOR) /* show information */
     WINDOW *w = e->docview.w;
     WINDOW *c = e->cmdview.w;
@@ -868,9 +2517,9 @@ COMMAND(sh, NOLOCATOR) /* show information */
     char *be = NULL;
     int oc = curs_set(0);
     if (v->bs != NONE)
-        bs = wstos(v->b->l[v->bs].s, v->b->l[v->bs].n);
+        bs = linetos(v->b, v->bs);
     if (v->be != NONE)
-        be = wstos(v->b->l[v->be].s, v->b->l[v->be].n);
+        be = linetos(v->b, v->be);
 
     wattron(w, A_BOLD);
     werase(w);
@@ -886,7 +2535,19 @@ COMMAND(sh, NOLOCATOR) /* show information */
         mvwprintw(w, 5, 0, "Right margin    %zu", v->rm + 1);
     mvwprintw(w, 6, 0, "Block start     %-.24s%s", bs? trimleft(bs) : "Not set", bs? "..." : "");
     mvwprintw(w, 7, 0, "Block end       %-.24s%s", be? trimleft(be) : "Not set", be? "..." : "");
-    mvwprintw(w, 9, 0, "Type any character to continue");
+    size_t th = v->b->text.held, tu = v->b->text.used;
+    mvwprintw(w, 8, 0, "Text storage    %zuK, %zuK unused (%zu%%)", th / 1024,
+              (th - tu) / 1024, th? (th - tu) * 100 / th : 0);
+    const BUFFER *d = e->docview.b;
+    if (d->cap)
+        mvwprintw(w, 9, 0, "Memory ceiling  %zuM, %zuK paged out to swap",
+                  d->cap >> 20, d->swapn / 1024);
+    else
+        mvwprintw(w, 9, 0, "Memory ceiling  Not set");
+    mvwprintw(w, 10, 0, "Packed blocks   %zu", d->npacked);
+    size_t chars, bytes = textsize(d, &chars);
+    mvwprintw(w, 11, 0, "File size       %zu bytes, %zu characters", bytes, chars);
+    mvwprintw(w, 12, 0, "Type any character to continue");
     wattroff(w, A_BOLD);
     wrefresh(w);
     free(bs);
@@ -955,6 +2616,8 @@ COMMAND(sm, MARK | NOLOCATOR) /* show matching brace */
       default: ERROR("Search failed");
    }
 
+   if (!r)
+      finishload(e, false);
    bool (*iter)(const BUFFER *, POS *) = r? prev : next;
    bool (*atend)(const BUFFER *, POS) = r? attop : atbot;
    do{
@@ -1063,7 +2726,7 @@ COMMAND(vw, NOLOCATOR) /* verify window */
     redrawwin(e->cmdview.w);
 END
 
-COMMAND(wb, NOLOCATOR) /* write block */
+COMMAND(wb, NOLOCATOR | WHOLEFILE) /* write block */
     if (v->bs == NONE || v->be == NONE)
         ERROR("No block defined");
 
@@ -1075,12 +2738,7 @@ COMMAND(wb, NOLOCATOR) /* write block */
     if (!fn)
         ERROR("Out of memory");
 
-    int fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (fd < 0){
-        free(fn);
-        ERROR("Could not open file");
-    }
-    bool r = writelines(fd, e, v->b, v->bs, v->be);
+    bool r = startsave(e, v->b, fn, v->bs, v->be - v->bs + 1, false);
     free(fn);
     RETURN(r);
 END
@@ -1119,7 +2777,7 @@ COMMAND(wp, MARK) /* previous word */
 END
 
 COMMAND(x, NOFLAGS) /* exit with save */
-    RETURN(cmd_sa(e, v, a) && cmd_q(e, v, a));
+    RETURN(cmd_sa(e, v, a) && finishsave(e, true) && cmd_q(e, v, a));
 END
 
 COMMAND(xq, NOLOCATOR) /* exit with save and query */
@@ -1168,6 +2826,7 @@ static CMD cmdtab[] ={
     {L"F",  ARG_STRING,     false, cmd_f},
     {L"FB", ARG_STRING,     true,  cmd_fb},
     {L"FC", ARG_NONE,       false, cmd_fc},
+    {L"FO", ARG_NONE,       true,  cmd_fo},
     {L"GB", ARG_NONE,       true,  cmd_gb},
     {L"GM", ARG_NUMBER,     true,  cmd_gm},
     {L"I",  ARG_STRING,     false, cmd_i},
@@ -1178,9 +2837,13 @@ static CMD cmdtab[] ={
     {L"LC", ARG_NONE,       true,  cmd_lc},
     {L"M",  ARG_NUMBER,     true,  cmd_m},
     {L"MC", ARG_EXCHANGE,   true,  cmd_mc},
+    {L"MO", ARG_NUMBER,     true,  cmd_mo},
+    {L"MP", ARG_NUMBER,     true,  cmd_mp},
     {L"MS", ARG_NONE,       true,  cmd_ms},
     {L"N",  ARG_NONE,       true,  cmd_n},
+    {L"NF", ARG_NONE,       true,  cmd_nf},
     {L"NI", ARG_NONE,       true,  cmd_ni},
+    {L"NX", ARG_NONE,       true,  cmd_nx},
     {L"P",  ARG_NONE,       true,  cmd_p},
     {L"PD", ARG_NONE,       true,  cmd_pd},
     {L"PH", ARG_NUMBER,     true,  cmd_ph},
@@ -1188,10 +2851,13 @@ static CMD cmdtab[] ={
     {L"Q",  ARG_STRING,     false, cmd_q},
     {L"QY", ARG_STRING,     false, cmd_qy},
     {L"RF", ARG_STRING,     true,  cmd_rf},
+    {L"RL", ARG_NONE,       true,  cmd_rl},
     {L"RM", ARG_NONE,       true,  cmd_rm},
+    {L"RX", ARG_NONE,       true,  cmd_rx},
     {L"SA", ARG_STRING,     false, cmd_sa},
     {L"S",  ARG_NONE,       true,  cmd_s},
     {L"SB", ARG_NONE,       true,  cmd_sb},
+    {L"SC", ARG_NUMBER,     true,  cmd_sc},
     {L"SD", ARG_NUMBER,     true,  cmd_sd},
     {L"SF", ARG_EXCHANGE,   true,  cmd_sf},
     {L"SH", ARG_NONE,       true,  cmd_sh},
@@ -31,6 +31,21 @@ struct CMD{
 const CMD *lookup(const wchar_t *s);
 bool call(const CMD *c, EDITOR *e, VIEW *v, const ARG *a);
 
+bool finishsave(EDITOR *e, bool wait);
+int saveprogress(EDITOR *e);
+bool startload(EDITOR *e, const char *fn);
+bool pollload(EDITOR *e, bool wait);
+void finishload(EDITOR *e, bool cancel);
+bool startfollow(EDITOR *e);
+void stopfollow(EDITOR *e, bool forget);
+bool pollfollow(EDITOR *e);
+bool following(const EDITOR *e);
+bool pollchange(EDITOR *e);
+void stopcount(EDITOR *e, bool forget);
+bool pollcount(EDITOR *e);
+bool counting(const EDITOR *e);
+bool counted(const EDITOR *e, size_t *nth, size_t *total);
+
 bool cmd_a(EDITOR *e, VIEW *v, const ARG *a); /* insert line after current */
 bool cmd_ai(EDITOR *e, VIEW *v, const ARG *a); /* enable auto-indent */
 bool cmd_b(EDITOR *e, VIEW *v, const ARG *a); /* move to bottom of file */
@@ -70,6 +85,7 @@ bool cmd_ex(EDITOR *e, VIEW *v, const ARG *a); /* expand right margin */
 bool cmd_f(EDITOR *e, VIEW *v, const ARG *a); /* find */
 bool cmd_fb(EDITOR *e, VIEW *v, const ARG *a); /* filter block */
 bool cmd_fc(EDITOR *e, VIEW *v, const ARG *a); /* flip case */
+bool cmd_fo(EDITOR *e, VIEW *v, const ARG *a); /* follow the file as it grows */
 bool cmd_gb(EDITOR *e, VIEW *v, const ARG *a); /* go back */
 bool cmd_gm(EDITOR *e, VIEW *v, const ARG *a); /* go to bookmark */
 bool cmd_hb(EDITOR *e, VIEW *v, const ARG *a); /* handle bracket */
@@ -81,9 +97,13 @@ bool cmd_j(EDITOR *e, VIEW *v, const ARG *a); /* join this line and next */
 bool cmd_lc(EDITOR *e, VIEW *v, const ARG *a); /* case-sensitive searching */
 bool cmd_m(EDITOR *e, VIEW *v, const ARG *a); /* move to line */
 bool cmd_mc(EDITOR *e, VIEW *v, const ARG *a); /* remap control key */
+bool cmd_mo(EDITOR *e, VIEW *v, const ARG *a); /* move to byte offset */
+bool cmd_mp(EDITOR *e, VIEW *v, const ARG *a); /* move to percentage of file */
 bool cmd_ms(EDITOR *e, VIEW *v, const ARG *a); /* show matches */
 bool cmd_n(EDITOR *e, VIEW *v, const ARG *a); /* move to beginning of next line */
+bool cmd_nf(EDITOR *e, VIEW *v, const ARG *a); /* don't follow the file */
 bool cmd_ni(EDITOR *e, VIEW *v, const ARG *a); /* disable autoindent */
+bool cmd_nx(EDITOR *e, VIEW *v, const ARG *a); /* literal searching */
 bool cmd_p(EDITOR *e, VIEW *v, const ARG *a); /* move to beginning of previous line */
 bool cmd_pd(EDITOR *e, VIEW *v, const ARG *a); /* page down */
 bool cmd_ph(EDITOR *e, VIEW *v, const ARG *a); /* define page hieght */
@@ -93,13 +113,16 @@ bool cmd_qo(EDITOR *e, VIEW *v, const ARG *a); /* quote next */
 bool cmd_qy(EDITOR *e, VIEW *v, const ARG *a); /* quit without save */
 bool cmd_rd(EDITOR *e, VIEW *v, const ARG *a); /* restore deleted */
 bool cmd_rf(EDITOR *e, VIEW *v, const ARG *a); /* run command file */
+bool cmd_rl(EDITOR *e, VIEW *v, const ARG *a); /* reload the file */
 bool cmd_rm(EDITOR *e, VIEW *v, const ARG *a); /* reset margins */
 bool cmd_rp(EDITOR *e, VIEW *v, const ARG *a); /* execute last extended command */
 bool cmd_ru(EDITOR *e, VIEW *v, const ARG *a); /* run extended command */
 bool cmd_rs(EDITOR *e, VIEW *v, const ARG *a); /* run extended command */
+bool cmd_rx(EDITOR *e, VIEW *v, const ARG *a); /* regular expression searching */
 bool cmd_s(EDITOR *e, VIEW *v, const ARG *a); /* split line */
 bool cmd_sa(EDITOR *e, VIEW *v, const ARG *a); /* save text to file */
 bool cmd_sb(EDITOR *e, VIEW *v, const ARG *a); /* show block on screen */
+bool cmd_sc(EDITOR *e, VIEW *v, const ARG *a); /* set memory ceiling */
 bool cmd_sd(EDITOR *e, VIEW *v, const ARG *a); /* set show delay */
 bool cmd_se(EDITOR *e, VIEW *v, const ARG *a); /* split line after moving to end */
 bool cmd_sf(EDITOR *e, VIEW *v, const ARG *a); /* set function key */
@@ -1,11 +1,13 @@
 #include <libgen.h>
 #include <stdbool.h>
 #include <string.h>
+#include <unistd.h>
 #include CURSES_INCLUDE
 
 #include "structs.h"
 #include "editor.h"
 #include "mode.h"
+#include "search.h"
 #include "util.h"
 
 /* The character used to fill an empty background.
@@ -18,6 +20,15 @@
 #define DEFAULT_TS 3
 #define DEFAULT_PH 12
 #define DEFAULT_SD 200
+
+/* The text of the file is paged out past half of physical memory. */
+static size_t
+defaultcap(void)
+{
+    long n = sysconf(_SC_PHYS_PAGES), s = sysconf(_SC_PAGESIZE);
+    return n > 0 && s > 0? (size_t)n / 2 * (size_t)s : 0;
+}
+
 static bool
 initview(VIEW *v, WINDOW *w, MODE *m, void (*statuscb)(EDITOR *e, VIEW *v))
 {
@@ -33,7 +44,7 @@ initview(VIEW *v, WINDOW *w, MODE *m, void (*statuscb)(EDITOR *e, VIEW *v))
     v->ph = DEFAULT_PH;
     v->sd = DEFAULT_SD;
     v->statuscb = statuscb;
-    v->delay = true;
+    v->delay = -1;
     return true;
 }
 
@@ -42,12 +53,52 @@ freeview(VIEW *v)
 {
     if (v){
         free(v->dl);
+        free(v->found);
         closebuffer(v->b);
         if (v->w && v->w != stdscr)
             delwin(v->w);
     }
 }
 
+/* While the match last found is highlighted, so are the others that
+ * could be in the window, wherever it is put to show the cursor.
+ */
+static void
+markfound(EDITOR *e, VIEW *v)
+{
+    BUFFER *b = v->b;
+    const TAG *h = b->tags + HIGHLIGHT;
+    size_t lines, cols, len;
+    getmaxyx(v->w, lines, cols);
+    v->nfound = 0;
+    if (!e->finder || h->p1.l == NONE || !lines)
+        return;
+
+    stopcount(e, false);
+    SNAPSHOT *s = b->snap? NULL : takesnapshot(b);
+    POS p = pos(v->p.l >= lines? v->p.l - lines + 1 : 0, 0), at;
+    while (s && search(e->finder, s, p, false, v->p.l + lines - 1, &at, &len) > 0){
+        if (at.c > v->p.c + cols){
+            p = pos(at.l + 1, 0);
+            continue;
+        }
+        if (v->nfound == v->afound){
+            size_t a = v->afound? v->afound * 2 : 64;
+            TAG *t = realloc(v->found, a * sizeof(TAG));
+            if (!t)
+                break;
+            v->found = t;
+            v->afound = a;
+        }
+        POS q = at;
+        for (size_t i = 0; i < len; i++)
+            next(b, &q);
+        v->found[v->nfound++] = (TAG){at, q, A_UNDERLINE};
+        p = pos(at.l, at.c + 1);
+    }
+    dropsnapshot(s);
+}
+
 static void
 docstatus(EDITOR *e, VIEW *v)
 {
@@ -71,15 +122,31 @@ docstatus(EDITOR *e, VIEW *v)
     else
         snprintf(lm, sizeof(lm) - 1, "%zu", v->lm == NONE? 1 : v->lm + 1);
 
+    char sv[25] = {0};
+    e->saving = saveprogress(e);
+    if (e->saving >= 0)
+        snprintf(sv, sizeof(sv) - 1, "Saving=%d%% ", e->saving);
+
+    char mt[50] = {0};
+    size_t nth, total;
+    markfound(e, v);
+    pollcount(e);
+    if (counted(e, &nth, &total) && nth)
+        snprintf(mt, sizeof(mt) - 1, "Match=%zu/%zu ", nth, total);
+
+    e->held = e->err[0];
     if (e->err[0])
         snprintf(buf, cols, "%s", e->err);
     else{
         char *fn = ellipsize(basename(e->name), 12, false);
         snprintf(buf, cols,
-         "%sFile=%-15s Line=%zu/%zu (%d%%) Col=%-5zu Block=%s%s %sTabs=%-2zu %sMargins=%s-%s",
+         "%sFile=%-15s %s%sLine=%zu/%zu%s (%d%%) Col=%-5zu Block=%s%s %sTabs=%-2zu %sMargins=%s-%s",
          v->b->dirty? "*" : " ",
          fn? fn : basename(e->name),
+         sv,
+         mt,
          !v->b->n? 0 : v->p.l + 1, v->b->n,
+         e->reader || following(e)? "+" : "",
          !v->b->n? 0 : (int)(100 * (((float)(v->p.l + 1)) / ((float)v->b->n))),
          v->p.c + 1,
          v->bs == NONE? "?" : "S",
@@ -120,6 +187,7 @@ openeditor(const char *name, WINDOW *docwin, WINDOW *cmdwin)
     }
 
     e->docview.se = true;
+    e->docview.b->cap = defaultcap();
     e->lc = pos(NONE, NONE);
     e->focusview = &e->docview;
     strncpy(e->name, name, FILENAME_MAX);
@@ -135,9 +203,14 @@ void
 closeeditor(EDITOR *e)
 {
     if (e){
+        finishload(e, true);
+        finishsave(e, true);
+        stopfollow(e, true);
         for (size_t i = 0; i < FUNC_MAX; i++)
             free(e->funcs[i]);
+        stopcount(e, true);
         free(e->find);
+        closesearch(e->finder);
         freeview(&e->cmdview);
         freeview(&e->docview);
         free(e);
@@ -163,6 +236,9 @@ dispatch(EDITOR *e, VIEW *v, KEYSTROKE i)
     if (!c)
         return;
     c(e, v, &a);
+    closegap(v->b, v->p.l); /* a line keeps its gap only while the cursor is on it */
+    pageout(e->docview.b, e->docview.p.l);
+    pack(e->docview.b, e->docview.p.l);
 }
 
 static void
@@ -203,10 +279,15 @@ between(POS p, POS a, POS b)
 }
 
 static int
-gettag(const BUFFER *b, POS p)
+gettag(const VIEW *v, POS p)
 {
    for (int i = 0; i < TAG_MAX; i++){
-      const TAG *t = b->tags + i;
+      const TAG *t = v->b->tags + i;
+      if (between(p, t->p1, t->p2))
+         return t->v;
+   }
+   for (size_t i = 0; i < v->nfound; i++){
+      const TAG *t = v->found + i;
       if (between(p, t->p1, t->p2))
          return t->v;
    }
@@ -227,11 +308,13 @@ redisplay(VIEW *v)
     for (l = 0; l < lines && v->tos.l + l < v->b->n; l++){
         size_t c = 0, i = 0;
         while (c < cols){
-            wattrset(v->w, gettag(v->b, pos(v->tos.l + l, v->tos.c + i)));
+            wattrset(v->w, gettag(v, pos(v->tos.l + l, v->tos.c + i)));
             wmove(v->w, l, c);
             if (v->tos.l + l == v->p.l && v->tos.c + i == v->p.c)
                 getyx(v->w, y, x);
             wchar_t w = charat(v->b, pos(v->tos.l + l, v->tos.c + i));
+            if (ISRAWBYTE(w))
+                w = isutf8()? 0xfffd : L'?';
             if (w == '\t'){
                 waddch(v->w, ' '); c++;
                 while (c % v->ts){
@@ -268,24 +351,81 @@ error(EDITOR *e, const char *s)
     return false;
 }
 
-KEYSTROKE
-getkeystroke(EDITOR *e, bool delay)
+/* While a file is being loaded, saved or followed, or the matches of the
+ * find target counted, input is waited for a tick at a time so that the
+ * screen can follow along and the end is noticed. When lines come on the
+ * end of a followed file with the cursor on the last line, it goes on to
+ * the new last line. Otherwise ticks are slower, and just look for the
+ * file being changed by something else.
+ */
+#define LOAD_TICK   20
+#define SAVE_TICK   100
+#define COUNT_TICK  50
+#define FOLLOW_TICK 250
+#define WATCH_TICK  1000
+static void
+tick(EDITOR *e)
 {
-    if (delay != e->focusview->delay){
-        nodelay(e->focusview->w, !delay);
-        e->focusview->delay = delay;
+    size_t n = e->docview.b->n;
+    bool loading = e->reader, added = pollload(e, false), whole = false;
+    if (pollfollow(e)){
+        added = true;
+        if ((whole = e->docview.p.l + 1 >= n && e->docview.b->n > n))
+            e->docview.p = pos(e->docview.b->n - 1, 0);
     }
+    if (pollchange(e))
+        added = whole = true;
+    if (mapcut()){
+        error(e, "File cut short on disk; text past its end is lost");
+        added = whole = true;
+    }
+    finishsave(e, false);
+    bool ended = pollcount(e);
+    pageout(e->docview.b, e->docview.p.l);
+    pack(e->docview.b, e->docview.p.l);
+    if (e->focusview != &e->docview || e->held)
+        return;
+    if (!added && !ended && loading == !!e->reader && !e->err[0] && saveprogress(e) == e->saving)
+        return;
 
+    int y, x;
+    getyx(e->docview.w, y, x);
+    docstatus(e, &e->docview);
+    if (added && (whole || n <= e->docview.tos.l + getmaxy(e->docview.w)))
+        redisplay(&e->docview);
+    else{
+        wmove(e->docview.w, y, x);
+        wrefresh(e->docview.w);
+    }
+}
+
+KEYSTROKE
+getkeystroke(EDITOR *e, bool delay)
+{
     KEYSTROKE k = {0};
     wint_t c = 0;
-    int o = wget_wch(e->focusview->w, &c);
-    while (o == KEY_CODE_YES && c == KEY_RESIZE){
-        redisplay(&e->docview);
-        if (e->focusview->statuscb)
-            e->focusview->statuscb(e, e->focusview);
-        redisplay(e->focusview);
+    int o = ERR;
+    for (;;){
+        int t = !delay? 0 : e->reader? LOAD_TICK : e->save? SAVE_TICK
+              : counting(e)? COUNT_TICK : following(e)? FOLLOW_TICK : WATCH_TICK;
+        if (t != e->focusview->delay){
+            wtimeout(e->focusview->w, t);
+            e->focusview->delay = t;
+        }
+
         o = wget_wch(e->focusview->w, &c);
+        if (o == KEY_CODE_YES && c == KEY_RESIZE){
+            redisplay(&e->docview);
+            if (e->focusview->statuscb)
+                e->focusview->statuscb(e, e->focusview);
+            redisplay(e->focusview);
+        } else if (o == ERR && t > 0)
+            tick(e);
+        else
+            break;
     }
+    if (o != ERR)
+        pollload(e, false); /* keep reading while keys come in */
     k.o = c == WEOF? ERR : o;
     k.c = c;
     return k;
@@ -16,10 +16,13 @@ struct VIEW{
     MODE *m;
     lineno bs, be;
     void (*statuscb)(EDITOR *e, VIEW *v);
-    bool ex, uc, delay, et, q, ai, sm, se;
+    bool ex, uc, re, et, q, ai, sm, se;
+    int delay; /* the window's input timeout */
     size_t ph, ts, lm, rm, sd;
     wchar_t *dl;
     size_t dln;
+    TAG *found; /* other matches shown along with the one found */
+    size_t nfound, afound;
 };
 
 #define FUNC_MAX 10
@@ -36,6 +39,15 @@ struct EDITOR{
     char err[ERR_MAX + 1];
     wchar_t *find;
     size_t findn;
+    SEARCH *finder; /* find compiled, and how it was to be searched for */
+    bool finduc, findre;
+    COUNT *count;   /* and its matches */
+    READER *reader;
+    SAVE *save;
+    FOLLOW *follow;
+    struct stat disk; /* the file as it was last read or written */
+    int saving; /* the save progress on the status line */
+    bool held;  /* an error is on the status line */
 };
 
 EDITOR *openeditor(const char *name, WINDOW *docwin, WINDOW *cmdwin);
@@ -0,0 +1,874 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "structs.h"
+#include "buffer.h"
+#include "pattern.h"
+
+/* Regular expressions are the extended ones of egrep, less back
+ * references and counted repeats: alternation with |, grouping, the
+ * repeats *, + and ?, the anchors ^ and $, . for any character,
+ * bracketed sets and ranges, and \d, \w and \s and their opposites. A
+ * backslash takes anything else literally.
+ *
+ * An expression is compiled to a graph of states joined by edges, each
+ * of which takes a character from a set, or none at all, or none so
+ * long as the line starts or ends there. Sets are boiled down to the
+ * runs of characters that no set splits, and those runs are what is
+ * matched; in a line folded to upper case a set matches what any of its
+ * characters folds to.
+ *
+ * Matching is done by machines whose states are sets of the graph's
+ * states, each made the first time some line gets to it and kept for
+ * the next, so that every character of a line is one step through a
+ * table however the expression was written. One machine runs backwards
+ * from the end of a line and notes each place a match could start; the
+ * other runs forwards from where one does to find where it ends, as
+ * late as it can. Either way a line is gone through once at most. When
+ * a machine has too many states they are all thrown away and made
+ * again as they are needed.
+ */
+#define CHAR_TOP   0x7fffffff /* the last character a set can hold */
+#define DFA_STATES 1024       /* before starting over */
+#define DFA_HASH   1024
+#define AT_BOL     1          /* where the line starts */
+#define AT_EOL     2          /* where it ends */
+#define MUST_MAX   4096       /* states to look for a string among */
+
+enum{EPS, SET, BOL, EOL};
+typedef struct{
+    size_t from, to;
+    int kind;
+    size_t set;
+} EDGE;
+
+typedef struct{
+    wint_t lo, hi;
+} RANGE;
+
+typedef struct{
+    RANGE *r;
+    size_t n, a;
+    bool single;  /* whether it is a character written as itself */
+    wchar_t ch;   /* and which */
+} CLASS;
+
+typedef struct DSTATE DSTATE;
+struct DSTATE{
+    size_t *set, n;  /* the graph's states, in order */
+    bool accept;     /* whether a match ends here, away from either end */
+    bool bol, eol;   /* or at the start or end of the line */
+    DSTATE *chain;
+    DSTATE *next[];  /* by run, once known */
+};
+
+typedef struct{
+    bool fore;          /* which way it runs along edges */
+    bool unanchored;    /* and whether a match can start anywhere */
+    size_t start, end;  /* the graph's states it starts and ends in */
+    size_t *first, *edges; /* each state's edges, out of the way it runs */
+    DSTATE *hash[DFA_HASH], *states[DFA_STATES];
+    DSTATE *starts[(AT_BOL | AT_EOL) + 1];
+    size_t nstates, flushes;
+} DFA;
+
+struct PATTERN{
+    EDGE *e;
+    size_t ne, ae, nodes;
+    CLASS *c;
+    size_t nc, ac;
+    wint_t *bounds; /* where each run of characters but the first starts */
+    size_t nb, nsym, ascii[0x80];
+    unsigned char *member; /* whether each set holds each run */
+    DFA fore, back;
+    wchar_t *must;      /* a string every match has in it */
+    size_t mustn;
+    size_t *work, *stack;
+    bool *seen;
+    wchar_t (*fold)(wchar_t);
+    const wchar_t *s;   /* the expression, while it is compiled */
+    size_t i, n;
+    const char *err;
+    bool failed;        /* memory ran out */
+};
+
+typedef struct{
+    size_t in, out;
+} FRAG;
+
+static size_t
+node(PATTERN *r)
+{
+    return r->nodes++;
+}
+
+static void
+edge(PATTERN *r, size_t from, size_t to, int kind, size_t set)
+{
+    if (r->ne == r->ae){
+        size_t a = r->ae? r->ae * 2 : 64;
+        EDGE *e = realloc(r->e, a * sizeof(EDGE));
+        if (!e){
+            r->err = "Out of memory";
+            return;
+        }
+        r->e = e;
+        r->ae = a;
+    }
+    r->e[r->ne++] = (EDGE){from, to, kind, set};
+}
+
+static void
+addrange(PATTERN *r, CLASS *k, wint_t lo, wint_t hi)
+{
+    if (k->n == k->a){
+        size_t a = k->a? k->a * 2 : 4;
+        RANGE *g = realloc(k->r, a * sizeof(RANGE));
+        if (!g){
+            r->err = "Out of memory";
+            return;
+        }
+        k->r = g;
+        k->a = a;
+    }
+    k->r[k->n++] = (RANGE){lo, hi};
+}
+
+static size_t
+newclass(PATTERN *r)
+{
+    if (r->nc == r->ac){
+        size_t a = r->ac? r->ac * 2 : 8;
+        CLASS *c = realloc(r->c, a * sizeof(CLASS));
+        if (!c){
+            r->err = "Out of memory";
+            return 0;
+        }
+        r->c = c;
+        r->ac = a;
+    }
+    r->c[r->nc] = (CLASS){NULL, 0, 0, false, 0};
+    return r->nc++;
+}
+
+static int
+byrange(const void *a, const void *b)
+{
+    const RANGE *x = a, *y = b;
+    return x->lo < y->lo? -1 : x->lo > y->lo;
+}
+
+/* Put what the characters of set k fold to in with them, and turn it
+ * inside out if negate, leaving its ranges in order and apart.
+ */
+static void
+finishclass(PATTERN *r, size_t k, bool negate)
+{
+    CLASS *c = r->c + k;
+    for (size_t i = 0, n = c->n; r->fold && i < n && !r->err; i++){
+        if (!c->r[i].lo && c->r[i].hi == CHAR_TOP)
+            break; /* everything folds to something in it */
+        for (wint_t x = c->r[i].lo; x <= c->r[i].hi && x <= 0x10ffff && !r->err; x++){
+            wint_t u = r->fold(x);
+            if (u != x)
+                addrange(r, c, u, u);
+        }
+    }
+    if (r->err)
+        return;
+
+    size_t n = 0;
+    qsort(c->r, c->n, sizeof(RANGE), byrange);
+    for (size_t i = 0; i < c->n; i++){
+        if (n && c->r[i].lo <= c->r[n - 1].hi + 1){
+            if (c->r[i].hi > c->r[n - 1].hi)
+                c->r[n - 1].hi = c->r[i].hi;
+        } else
+            c->r[n++] = c->r[i];
+    }
+    c->n = n;
+    if (!negate)
+        return;
+
+    RANGE *g = c->r;
+    wint_t lo = 0;
+    c->r = NULL;
+    c->n = c->a = 0;
+    for (size_t i = 0; i < n; lo = g[i++].hi + 1){
+        if (g[i].lo > lo)
+            addrange(r, c, lo, g[i].lo - 1);
+    }
+    if (!n || g[n - 1].hi < CHAR_TOP)
+        addrange(r, c, lo, CHAR_TOP);
+    free(g);
+}
+
+/* A piece that takes a character in set k. */
+static FRAG
+take(PATTERN *r, size_t k)
+{
+    FRAG f = {node(r), node(r)};
+    edge(r, f.in, f.out, SET, k);
+    return f;
+}
+
+/* Make set k just c, which folded is just what it folds to. */
+static void
+single(PATTERN *r, size_t k, wchar_t c)
+{
+    r->c[k].single = true;
+    r->c[k].ch = c;
+    addrange(r, r->c + k, r->fold? r->fold(c) : c, r->fold? r->fold(c) : c);
+}
+
+/* Add what the escape \c stands for to set k, if it is one of \d, \w or
+ * \s, returning whether it was and whether it is negated in *negate.
+ */
+static bool
+shorthand(PATTERN *r, size_t k, wchar_t c, bool *negate)
+{
+    CLASS *x = r->c + k;
+    *negate = c == L'D' || c == L'W' || c == L'S';
+    switch (c){
+        case L'd': case L'D':
+            addrange(r, x, L'0', L'9');
+            return true;
+
+        case L'w': case L'W':
+            addrange(r, x, L'0', L'9');
+            addrange(r, x, L'A', L'Z');
+            addrange(r, x, L'_', L'_');
+            addrange(r, x, L'a', L'z');
+            return true;
+
+        case L's': case L'S':
+            addrange(r, x, L'\t', L'\r');
+            addrange(r, x, L' ', L' ');
+            return true;
+    }
+    return false;
+}
+
+static wchar_t
+literal(wchar_t c)
+{
+    return c == L't'? L'\t' : c == L'n'? L'\n' : c == L'r'? L'\r' : c == L'f'? L'\f' : c == L'v'? L'\v' : c;
+}
+
+/* A bracketed set, its opening bracket already read. */
+static FRAG
+bracket(PATTERN *r)
+{
+    size_t k = newclass(r);
+    bool negate = r->i < r->n && r->s[r->i] == L'^';
+    if (r->err)
+        return (FRAG){0, 0};
+    r->i += negate;
+    for (bool first = true; !r->err; first = false){
+        if (r->i >= r->n){
+            r->err = "Unmatched [";
+            return (FRAG){0, 0};
+        }
+        wchar_t c = r->s[r->i++], d;
+        if (c == L']' && !first)
+            break;
+
+        CLASS *x = r->c + k;
+        if (c == L'\\' && r->i < r->n){
+            bool v;
+            size_t n = x->n;
+            c = r->s[r->i++];
+            if (shorthand(r, k, c, &v)){
+                if (v){ /* a set inside a set: put its inside out in place */
+                    CLASS t;
+                    size_t tk = newclass(r);
+                    if (r->err)
+                        return (FRAG){0, 0};
+                    x = r->c + k;
+                    for (size_t i = n; i < x->n; i++)
+                        addrange(r, r->c + tk, x->r[i].lo, x->r[i].hi);
+                    x->n = n;
+                    finishclass(r, tk, true);
+                    t = r->c[tk];
+                    for (size_t i = 0; i < t.n; i++)
+                        addrange(r, r->c + k, t.r[i].lo, t.r[i].hi);
+                    free(t.r);
+                    r->nc--;
+                }
+                continue;
+            }
+            c = literal(c);
+        }
+        if (r->i + 1 < r->n && r->s[r->i] == L'-' && r->s[r->i + 1] != L']'){
+            d = r->s[r->i + 1];
+            r->i += 2;
+            if (d == L'\\' && r->i < r->n)
+                d = literal(r->s[r->i++]);
+            if ((wint_t)d < (wint_t)c){
+                r->err = "Invalid range";
+                return (FRAG){0, 0};
+            }
+        } else
+            d = c;
+        addrange(r, x, c, d);
+    }
+    if (!r->err)
+        finishclass(r, k, negate);
+    return take(r, k);
+}
+
+static FRAG alternation(PATTERN *r);
+
+static FRAG
+atom(PATTERN *r)
+{
+    wchar_t c = r->s[r->i++];
+    FRAG f;
+    size_t k;
+    bool negate;
+    switch (c){
+        case L'(':
+            f = alternation(r);
+            if (r->i >= r->n || r->s[r->i] != L')'){
+                if (!r->err)
+                    r->err = "Unmatched (";
+            } else
+                r->i++;
+            return f;
+
+        case L'*': case L'+': case L'?':
+            r->err = "Nothing to repeat";
+            return (FRAG){0, 0};
+
+        case L'[':
+            return bracket(r);
+
+        case L'.':
+            k = newclass(r);
+            if (!r->err){
+                addrange(r, r->c + k, 0, CHAR_TOP);
+                finishclass(r, k, false);
+            }
+            return take(r, k);
+
+        case L'^': case L'$':
+            f = (FRAG){node(r), node(r)};
+            edge(r, f.in, f.out, c == L'^'? BOL : EOL, 0);
+            return f;
+
+        case L'\\':
+            if (r->i >= r->n){
+                r->err = "Trailing backslash";
+                return (FRAG){0, 0};
+            }
+            c = r->s[r->i++];
+            k = newclass(r);
+            if (r->err)
+                return (FRAG){0, 0};
+            if (!shorthand(r, k, c, &negate))
+                single(r, k, literal(c));
+            else if (!r->err)
+                finishclass(r, k, negate);
+            return take(r, k);
+    }
+    k = newclass(r);
+    if (!r->err)
+        single(r, k, c);
+    return take(r, k);
+}
+
+static FRAG
+piece(PATTERN *r)
+{
+    FRAG f = atom(r);
+    for (wchar_t c; !r->err && r->i < r->n && ((c = r->s[r->i]) == L'*' || c == L'+' || c == L'?'); r->i++){
+        FRAG g = {node(r), node(r)};
+        edge(r, g.in, f.in, EPS, 0);
+        edge(r, f.out, g.out, EPS, 0);
+        if (c != L'+')
+            edge(r, g.in, g.out, EPS, 0);
+        if (c != L'?')
+            edge(r, f.out, f.in, EPS, 0);
+        f = g;
+    }
+    return f;
+}
+
+static FRAG
+branch(PATTERN *r)
+{
+    size_t a = node(r);
+    FRAG f = {a, a};
+    while (!r->err && r->i < r->n && r->s[r->i] != L'|' && r->s[r->i] != L')'){
+        FRAG g = piece(r);
+        edge(r, f.out, g.in, EPS, 0);
+        f.out = g.out;
+    }
+    return f;
+}
+
+static FRAG
+alternation(PATTERN *r)
+{
+    FRAG f = branch(r);
+    while (!r->err && r->i < r->n && r->s[r->i] == L'|'){
+        r->i++;
+        FRAG g = branch(r), h = {node(r), node(r)};
+        edge(r, h.in, f.in, EPS, 0);
+        edge(r, h.in, g.in, EPS, 0);
+        edge(r, f.out, h.out, EPS, 0);
+        edge(r, g.out, h.out, EPS, 0);
+        f = h;
+    }
+    return f;
+}
+
+/* Which run character c is in. */
+static size_t
+lookup(const PATTERN *r, wint_t c)
+{
+    size_t lo = 0, hi = r->nb;
+    while (lo < hi){
+        size_t m = lo + (hi - lo) / 2;
+        if (r->bounds[m] <= c)
+            lo = m + 1;
+        else
+            hi = m;
+    }
+    return lo;
+}
+
+static size_t
+symbol(const PATTERN *r, wint_t c)
+{
+    return c < 0x80? r->ascii[c] : lookup(r, c);
+}
+
+static int
+bybound(const void *a, const void *b)
+{
+    wint_t x = *(const wint_t *)a, y = *(const wint_t *)b;
+    return x < y? -1 : x > y;
+}
+
+/* Cut the characters into runs that no set splits. */
+static bool
+runs(PATTERN *r)
+{
+    size_t n = 0;
+    for (size_t k = 0; k < r->nc; k++)
+        n += 2 * r->c[k].n;
+    if (!(r->bounds = malloc((n + 1) * sizeof(wint_t))))
+        return false;
+    for (size_t k = 0; k < r->nc; k++){
+        for (size_t i = 0; i < r->c[k].n; i++){
+            r->bounds[r->nb++] = r->c[k].r[i].lo;
+            if (r->c[k].r[i].hi < CHAR_TOP)
+                r->bounds[r->nb++] = r->c[k].r[i].hi + 1;
+        }
+    }
+    qsort(r->bounds, r->nb, sizeof(wint_t), bybound);
+    n = 0;
+    for (size_t i = 0; i < r->nb; i++){
+        if (r->bounds[i] && (!n || r->bounds[i] != r->bounds[n - 1]))
+            r->bounds[n++] = r->bounds[i];
+    }
+    r->nb = n;
+    r->nsym = n + 1;
+    for (wint_t c = 0; c < 0x80; c++)
+        r->ascii[c] = lookup(r, c);
+
+    if (!(r->member = calloc(r->nc * r->nsym + 1, 1)))
+        return false;
+    for (size_t k = 0; k < r->nc; k++){
+        for (size_t i = 0; i < r->c[k].n; i++){
+            for (size_t s = symbol(r, r->c[k].r[i].lo), e = symbol(r, r->c[k].r[i].hi); s <= e; s++)
+                r->member[k * r->nsym + s] = 1;
+        }
+    }
+    return true;
+}
+
+/* Ready d to run over the graph, forwards or backwards. */
+static bool
+ready(PATTERN *r, DFA *d, bool fore, size_t start, size_t end)
+{
+    d->fore = fore;
+    d->unanchored = !fore;
+    d->start = start;
+    d->end = end;
+    if (!(d->first = calloc(r->nodes + 1, sizeof(size_t)))
+    ||  !(d->edges = malloc((r->ne + 1) * sizeof(size_t))))
+        return false;
+    for (size_t i = 0; i < r->ne; i++)
+        d->first[(fore? r->e[i].from : r->e[i].to) + 1]++;
+    for (size_t i = 0; i < r->nodes; i++)
+        d->first[i + 1] += d->first[i];
+    memcpy(r->work, d->first, r->nodes * sizeof(size_t));
+    for (size_t i = 0; i < r->ne; i++)
+        d->edges[r->work[fore? r->e[i].from : r->e[i].to]++] = i;
+    return true;
+}
+
+/* Whether every match goes through state b: whether the end can't be
+ * got to from the start without it.
+ */
+static bool
+through(PATTERN *r, size_t b)
+{
+    const DFA *d = &r->fore;
+    size_t k = 0;
+    bool found = false;
+    r->seen[b] = true;
+    if (!r->seen[d->start]){
+        r->seen[d->start] = true;
+        r->stack[k++] = d->start;
+    }
+    while (k && !found){
+        size_t u = r->stack[--k];
+        found = u == d->end;
+        for (size_t j = d->first[u]; j < d->first[u + 1]; j++){
+            size_t v = r->e[d->edges[j]].to;
+            if (!r->seen[v]){
+                r->seen[v] = true;
+                r->stack[k++] = v;
+            }
+        }
+    }
+    memset(r->seen, 0, r->nodes * sizeof(bool));
+    return !found;
+}
+
+/* Find the longest string that every match has in it: characters written
+ * as themselves that a match, once it has taken the first, can only go on
+ * through one after another. Spaces are left out, being the ends of lines
+ * as well to a search for a string.
+ */
+static bool
+findmust(PATTERN *r)
+{
+    const DFA *d = &r->fore;
+    wchar_t *t = malloc((r->ne + 1) * sizeof(wchar_t));
+    if (!t || !(r->must = malloc((r->ne + 1) * sizeof(wchar_t))))
+        return free(t), false;
+    for (size_t i = 0; i < r->ne && r->nodes <= MUST_MAX; i++){
+        const EDGE *e = r->e + i;
+        if (e->kind != SET || !r->c[e->set].single || r->c[e->set].ch == L' ' || !through(r, e->to))
+            continue;
+
+        size_t n = 0;
+        t[n++] = r->c[e->set].ch;
+        for (size_t u = e->to, k = 0; d->first[u + 1] - d->first[u] == 1 && k < r->nodes; k++){
+            const EDGE *f = r->e + d->edges[d->first[u]];
+            if (f->kind == SET){
+                if (!r->c[f->set].single || r->c[f->set].ch == L' ')
+                    break;
+                t[n++] = r->c[f->set].ch;
+            }
+            u = f->to;
+        }
+        if (n > r->mustn){
+            wchar_t *w = r->must;
+            r->must = t;
+            r->mustn = n;
+            t = w;
+        }
+    }
+    free(t);
+    return true;
+}
+
+static void
+flush(DFA *d)
+{
+    for (size_t i = 0; i < d->nstates; i++){
+        free(d->states[i]->set);
+        free(d->states[i]);
+    }
+    memset(d->hash, 0, sizeof(d->hash));
+    memset(d->starts, 0, sizeof(d->starts));
+    d->nstates = 0;
+    d->flushes++;
+}
+
+PATTERN *
+openpattern(const wchar_t *s, size_t n, wchar_t (*fold)(wchar_t), const char **err)
+{
+    PATTERN *r = calloc(1, sizeof(PATTERN));
+    if (!r)
+        return *err = "Out of memory", NULL;
+    r->s = s;
+    r->n = n;
+    r->fold = fold;
+
+    FRAG f = alternation(r);
+    if (!r->err && r->i < r->n)
+        r->err = "Unmatched )";
+    if (r->err){
+        *err = r->err;
+        return closepattern(r), NULL;
+    }
+    r->s = NULL;
+
+    if (!runs(r)
+    ||  !(r->work = malloc((r->nodes + 1) * sizeof(size_t)))
+    ||  !(r->stack = malloc(r->nodes * sizeof(size_t)))
+    ||  !(r->seen = calloc(r->nodes, sizeof(bool)))
+    ||  !ready(r, &r->fore, true, f.in, f.out)
+    ||  !ready(r, &r->back, false, f.out, f.in)
+    ||  !findmust(r)){
+        *err = "Out of memory";
+        return closepattern(r), NULL;
+    }
+    return r;
+}
+
+void
+closepattern(PATTERN *r)
+{
+    if (r){
+        DFA *d[] = {&r->fore, &r->back};
+        for (size_t i = 0; i < 2; i++){
+            flush(d[i]);
+            free(d[i]->first);
+            free(d[i]->edges);
+        }
+        for (size_t k = 0; k < r->nc; k++)
+            free(r->c[k].r);
+        free(r->c);
+        free(r->e);
+        free(r->bounds);
+        free(r->member);
+        free(r->must);
+        free(r->work);
+        free(r->stack);
+        free(r->seen);
+        free(r);
+    }
+}
+
+static int
+bynode(const void *a, const void *b)
+{
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return x < y? -1 : x > y;
+}
+
+/* Put in with the n states at r->work all that can be got to from them
+ * without taking a character, crossing the ends of the line in flags,
+ * leaving them in order; this returns how many there are.
+ */
+static size_t
+closure(PATTERN *r, const DFA *d, size_t n, int flags)
+{
+    size_t k = 0;
+    for (size_t i = 0; i < n; i++){
+        if (!r->seen[r->work[i]]){
+            r->seen[r->work[i]] = true;
+            r->stack[k++] = r->work[i];
+        }
+    }
+    for (n = 0; k; ){
+        size_t u = r->stack[--k];
+        r->work[n++] = u;
+        for (size_t j = d->first[u]; j < d->first[u + 1]; j++){
+            const EDGE *e = r->e + d->edges[j];
+            size_t v = d->fore? e->to : e->from;
+            if (!r->seen[v] && (e->kind == EPS || (e->kind == BOL && flags & AT_BOL) || (e->kind == EOL && flags & AT_EOL))){
+                r->seen[v] = true;
+                r->stack[k++] = v;
+            }
+        }
+    }
+    for (size_t i = 0; i < n; i++)
+        r->seen[r->work[i]] = false;
+    qsort(r->work, n, sizeof(size_t), bynode);
+    return n;
+}
+
+static bool
+holds(const size_t *set, size_t n, size_t u)
+{
+    return bsearch(&u, set, n, sizeof(size_t), bynode) != NULL;
+}
+
+/* Whether the machine ends a match in s at an end of the line. */
+static bool
+accepts(PATTERN *r, const DFA *d, const DSTATE *s, int flags)
+{
+    memcpy(r->work, s->set, s->n * sizeof(size_t));
+    return holds(r->work, closure(r, d, s->n, flags), d->end);
+}
+
+/* The machine's state for the n states at r->work, made if need be. */
+static DSTATE *
+intern(PATTERN *r, DFA *d, size_t n)
+{
+    size_t h = n;
+    for (size_t i = 0; i < n; i++)
+        h = h * 31 + r->work[i];
+    h %= DFA_HASH;
+    for (DSTATE *s = d->hash[h]; s; s = s->chain){
+        if (s->n == n && !memcmp(s->set, r->work, n * sizeof(size_t)))
+            return s;
+    }
+
+    if (d->nstates == DFA_STATES)
+        flush(d);
+    DSTATE *s = calloc(1, sizeof(DSTATE) + r->nsym * sizeof(DSTATE *));
+    size_t *set = malloc((n + 1) * sizeof(size_t));
+    if (!s || !set){
+        free(s);
+        free(set);
+        return NULL;
+    }
+    memcpy(set, r->work, n * sizeof(size_t));
+    s->set = set;
+    s->n = n;
+    s->accept = holds(set, n, d->end);
+    s->bol = accepts(r, d, s, AT_BOL);
+    s->eol = accepts(r, d, s, AT_EOL);
+    s->chain = d->hash[h];
+    d->hash[h] = s;
+    d->states[d->nstates++] = s;
+    return s;
+}
+
+static DSTATE *
+startstate(PATTERN *r, DFA *d, int flags)
+{
+    if (!d->starts[flags]){
+        r->work[0] = d->start;
+        d->starts[flags] = intern(r, d, closure(r, d, 1, flags));
+    }
+    return d->starts[flags];
+}
+
+/* The state after s on a character in run k, or NULL if memory ran out.
+ * Making it may throw s away.
+ */
+static DSTATE *
+step(PATTERN *r, DFA *d, DSTATE *s, size_t k)
+{
+    if (s->next[k])
+        return s->next[k];
+    size_t n = 0, flushes = d->flushes;
+    for (size_t i = 0; i < s->n; i++){
+        size_t u = s->set[i];
+        for (size_t j = d->first[u]; j < d->first[u + 1]; j++){
+            const EDGE *e = r->e + d->edges[j];
+            if (e->kind == SET && r->member[e->set * r->nsym + k])
+                r->work[n++] = d->fore? e->to : e->from;
+        }
+    }
+    if (d->unanchored)
+        r->work[n++] = d->start;
+    DSTATE *t = intern(r, d, closure(r, d, n, 0));
+    if (t && d->flushes == flushes)
+        s->next[k] = t;
+    return t;
+}
+
+/* Where a match starts in the n characters at t: the first place at c
+ * or after it, or if last the last at c or before it, or NONE.
+ */
+static size_t
+begins(PATTERN *r, const wchar_t *t, size_t n, size_t c, bool last)
+{
+    DFA *d = &r->back;
+    DSTATE *s = startstate(r, d, AT_EOL | (n? 0 : AT_BOL)), *u;
+    size_t best = s && s->accept && (!last || n <= c)? n : NONE, k;
+    for (size_t i = n; s && i && (last? best == NONE : i > c); s = u){
+        k = symbol(r, t[--i]);
+        if (!(u = s->next[k]) && !(u = step(r, d, s, k)))
+            return r->failed = true, NONE;
+        if ((i? u->accept : u->bol) && (!last || i <= c))
+            best = i;
+    }
+    if (!s)
+        r->failed = true;
+    return best;
+}
+
+/* Where the longest match starting at i in them ends, or NONE. */
+static size_t
+ends(PATTERN *r, const wchar_t *t, size_t n, size_t i)
+{
+    DFA *d = &r->fore;
+    DSTATE *s = startstate(r, d, (i? 0 : AT_BOL) | (i == n? AT_EOL : 0));
+    size_t best = s && s->accept? i : NONE;
+    while (s && s->n && i < n){
+        s = step(r, d, s, symbol(r, t[i++]));
+        if (s && (i < n? s->accept : s->eol))
+            best = i;
+    }
+    if (!s)
+        r->failed = true;
+    return best;
+}
+
+static int
+match(PATTERN *r, const wchar_t *t, size_t n, size_t c, bool last, size_t *at, size_t *len)
+{
+    r->failed = false;
+    size_t i = begins(r, t, n, c < n? c : n, last);
+    size_t j = i == NONE? NONE : ends(r, t, n, i);
+    if (r->failed)
+        return -1;
+    if (j == NONE)
+        return 0;
+    *at = i;
+    *len = j - i;
+    return 1;
+}
+
+/* Find the longest match of r that starts first in the n characters at
+ * t at column c or after it, folded as r was compiled to be. This returns
+ * 1 with where it is in *at and how long in *len, 0 if there isn't one
+ * and -1 if memory ran out.
+ */
+int
+firstmatch(PATTERN *r, const wchar_t *t, size_t n, size_t c, size_t *at, size_t *len)
+{
+    return c > n? 0 : match(r, t, n, c, false, at, len);
+}
+
+/* The same for the one that starts last at c or before it. */
+int
+lastmatch(PATTERN *r, const wchar_t *t, size_t n, size_t c, size_t *at, size_t *len)
+{
+    return match(r, t, n, c, true, at, len);
+}
+
+/* Count into *k the places before column end in the n characters at t
+ * that a match starts at, which are those firstmatch would find going on
+ * each time from just past the last, in one pass back along them. This
+ * returns false if memory ran out.
+ */
+bool
+matchstarts(PATTERN *r, const wchar_t *t, size_t n, size_t end, size_t *k)
+{
+    DFA *d = &r->back;
+    DSTATE *s = startstate(r, d, AT_EOL | (n? 0 : AT_BOL)), *u;
+    *k = s && s->accept && n < end;
+    for (size_t i = n, y; s && i; s = u){
+        y = symbol(r, t[--i]);
+        if (!(u = s->next[y]) && !(u = step(r, d, s, y)))
+            return false;
+        if ((i? u->accept : u->bol) && i < end)
+            (*k)++;
+    }
+    return s != NULL;
+}
+
+/* A string, as it was written, that a line must have in it to match, in
+ * *s; this returns how long it is, which may be nothing.
+ */
+size_t
+musthave(const PATTERN *r, const wchar_t **s)
+{
+    *s = r->must;
+    return r->mustn;
+}
@@ -0,0 +1,16 @@
+#ifndef PATTERN_H
+#define PATTERN_H
+
+#include <stdbool.h>
+#include <wchar.h>
+
+#include "structs.h"
+
+PATTERN *openpattern(const wchar_t *s, size_t n, wchar_t (*fold)(wchar_t), const char **err);
+void closepattern(PATTERN *r);
+int firstmatch(PATTERN *r, const wchar_t *t, size_t n, size_t c, size_t *at, size_t *len);
+int lastmatch(PATTERN *r, const wchar_t *t, size_t n, size_t c, size_t *at, size_t *len);
+bool matchstarts(PATTERN *r, const wchar_t *t, size_t n, size_t end, size_t *k);
+size_t musthave(const PATTERN *r, const wchar_t **s);
+
+#endif
@@ -0,0 +1,779 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+
+#include "structs.h"
+#include "buffer.h"
+#include "pattern.h"
+#include "search.h"
+#include "util.h"
+
+/* A target is looked for in a snapshot of its buffer, so that nothing
+ * that is searched gets decoded into the buffer on the way. As it reads
+ * everywhere else, the end of a line counts as a space, and so a target
+ * with a space in it may run from the end of one line onto the next.
+ *
+ * Within a line the target is found by Horspool's method: the last
+ * character under each place it could start says how far along the next
+ * such place can be, which is usually the whole length of the target.
+ * Going backwards the first character does the same the other way. Wide
+ * characters are skipped by their low byte, so that the tables stay
+ * small; that only makes a skip shorter than it could be.
+ *
+ * Lines still as they were read are searched as bytes where that comes
+ * to the same thing, as it does in UTF-8 for a target that is all whole
+ * characters: no well-formed sequence starts in the middle of another.
+ * There the target's rarest byte is scanned for with memchr, which the C
+ * library does a vector at a time, with Horspool's method to fall back
+ * on should that byte turn out not to be rare. Such lines that lie one
+ * after another in their file are searched as a single run, so that a
+ * file that hasn't been touched is searched at about the speed it can
+ * be read. Any other line is widened into a scratch line first.
+ *
+ * To ignore case the target is folded to upper case once, and the text
+ * as it is searched, through tables made for the purpose. Lines kept as
+ * bytes are then scanned for one of the target's ASCII characters that
+ * nothing else folds to, a letter in both cases at once, and the text
+ * around each one found is decoded and folded to see whether the rest of
+ * the target is there. Folding can change how many bytes a character
+ * takes, so nothing is skipped that way. For a target with no such
+ * character every line is widened and folded.
+ *
+ * A regular expression is matched a line at a time, the line widened and
+ * folded as for any other target, by the machine in pattern.c. Where it
+ * has a string that every match must have, as most do, only the lines
+ * that a search for that string turns up are matched.
+ */
+#define SKIP        256
+#define SCAN_MISSES 16 /* for a scan to give up on, once they come more */
+#define SCAN_GAP    32 /* often than this many bytes apart on average */
+struct SEARCH{
+    wchar_t *s;   /* the target, folded to upper case if fold */
+    size_t n;
+    bool fold;
+    size_t skip[SKIP], bskip[SKIP];   /* forwards and backwards */
+    unsigned char *m; /* the target encoded, if lines can be searched as bytes */
+    size_t mn;
+    size_t mskip[SKIP], mbskip[SKIP];
+    unsigned char up[0x80]; /* what each ASCII byte of text folds to */
+    size_t rare, at;  /* which byte of m to scan for, and which character */
+    bool caseless;    /* and whether it is a letter to scan for in either case */
+    size_t *sp, nsp;  /* where the target's spaces are */
+    PATTERN *rx;      /* the target compiled, if it is an expression */
+    SEARCH *must;     /* and a search for what every match has in it */
+    size_t len;       /* how long what was found is */
+    wchar_t *t, *u;   /* scratch for a line and for those a match runs onto */
+    size_t ta, ua;
+    bool failed;      /* memory ran out */
+};
+
+/* A guess at how often byte c turns up in text, for picking the byte of
+ * a target to scan for: spaces and then letters by how common they are
+ * in English, digits, punctuation, and last the bytes of other letters.
+ */
+static int
+often(unsigned char c)
+{
+    static const char letters[] = "etaoinsrhldcumfpgwybvkxjqz";
+    const char *p = c >= 'A' && c < 0x80? strchr(letters, c | 0x20) : NULL;
+    if (c == ' ')
+        return 100;
+    if (p && c >= 'a')
+        return 90 - (p - letters);
+    if (c >= '0' && c <= '9')
+        return 60;
+    if (p)
+        return 50 - (p - letters);
+    return c < 0x80? 20 : c < 0xc0? 10 : 5;
+}
+
+/* Folding to upper case goes through a table made once for the Basic
+ * Multilingual Plane, which has all but a few cased letters, and falls
+ * back on towupper above it. Alongside it is noted which ASCII characters
+ * anything else folds to, such as the I that a dotless i does. The tables
+ * are made by opensearch on the editing thread, before any search can be
+ * running off them.
+ */
+#define FOLD_MAX 0x10000
+static wchar_t *folds;
+static bool foreign[0x80];
+
+static bool
+foldtable(void)
+{
+    if (!folds && (folds = malloc(FOLD_MAX * sizeof(wchar_t))) != NULL){
+        for (wint_t c = 0; c < FOLD_MAX; c++){
+            folds[c] = towupper(c);
+            if (c >= 0x80 && (wint_t)folds[c] < 0x80)
+                foreign[folds[c]] = true;
+        }
+    }
+    return folds != NULL;
+}
+
+static wchar_t
+foldchar(wchar_t c)
+{
+    return (wint_t)c < FOLD_MAX? folds[c] : (wchar_t)towupper(c);
+}
+
+/* Ready a search for the n characters at s, ignoring case if fold and
+ * taking them as a regular expression if re. This returns NULL with why
+ * in *err if it can't.
+ */
+SEARCH *
+opensearch(const wchar_t *s, size_t n, bool fold, bool re, const char **err)
+{
+    SEARCH *x = calloc(1, sizeof(SEARCH));
+    *err = "Out of memory";
+    if (!x || !(x->s = dupstr(s, n))
+    ||  !(x->sp = calloc(n, sizeof(size_t)))
+    ||  (fold && !foldtable()))
+        return closesearch(x), NULL;
+    x->n = x->len = n;
+    x->fold = fold;
+    if (re){
+        const wchar_t *m;
+        size_t k;
+        if (!(x->rx = openpattern(s, n, fold? foldchar : NULL, err)))
+            return closesearch(x), NULL;
+        if (((k = musthave(x->rx, &m)) > 1 || (k && m[0] < 0x80 && often(m[0]) < 50))
+        &&  !(x->must = opensearch(m, k, fold, false, err)))
+            return closesearch(x), NULL;
+        return x;
+    }
+
+    bool bytes = isutf8();
+    for (size_t i = 0; i < 0x80; i++){
+        wint_t c = fold? (wint_t)folds[i] : i;
+        if (c >= 0x80)
+            bytes = false; /* as an i does in Turkish */
+        x->up[i] = c;
+    }
+    for (size_t i = 0; i < n; i++){
+        if (fold)
+            x->s[i] = foldchar(x->s[i]);
+        if (x->s[i] == L'\n' || x->s[i] > 0x10ffff || (x->s[i] >= 0xd800 && x->s[i] < 0xe000))
+            bytes = false; /* no bytes of a line match these */
+    }
+    if (bytes && !(x->m = malloc(n * 4)))
+        return closesearch(x), NULL;
+
+    /* folded, what is scanned for must be an ASCII character that only it
+     * folds to, or a letter that only it and its other case do
+     */
+    size_t to[0x80] = {0};
+    for (size_t i = 0; i < 0x80; i++)
+        to[x->up[i]]++;
+    x->rare = NONE;
+    for (size_t i = 0; i < n; i++){
+        wint_t c = x->s[i];
+        bool caseless = c < 0x80 && to[c] == 2 && c != (c | 0x20) && x->up[c | 0x20] == c;
+        if (fold && x->m && c < 0x80 && !foreign[c] && x->up[c] == c && (to[c] == 1 || caseless)
+        &&  (x->rare == NONE || often(c) <= often(x->m[x->rare]))){
+            x->rare = x->mn;
+            x->at = i;
+            x->caseless = caseless;
+        }
+        if (c == L' ')
+            x->sp[x->nsp++] = i;
+        if (x->m)
+            x->mn += utf8encode(c, (char *)x->m + x->mn);
+    }
+    if (fold && x->rare == NONE){
+        free(x->m);
+        x->m = NULL;
+        x->mn = 0;
+    }
+    for (size_t i = 0; !fold && i < x->mn; i++)
+        if (x->rare == NONE || often(x->m[i]) <= often(x->m[x->rare]))
+            x->rare = i;
+
+    for (size_t i = 0; i < SKIP; i++){
+        x->skip[i] = x->bskip[i] = n;
+        x->mskip[i] = x->mbskip[i] = x->mn;
+    }
+    for (size_t i = 0; i + 1 < n; i++)
+        x->skip[x->s[i] & 0xff] = n - 1 - i;
+    for (size_t i = n - 1; i > 0; i--)
+        x->bskip[x->s[i] & 0xff] = i;
+    for (size_t i = 0; i + 1 < x->mn; i++)
+        x->mskip[x->m[i]] = x->mn - 1 - i;
+    for (size_t i = x->mn? x->mn - 1 : 0; i > 0; i--)
+        x->mbskip[x->m[i]] = i;
+    return x;
+}
+
+void
+closesearch(SEARCH *x)
+{
+    if (x){
+        free(x->s);
+        free(x->m);
+        free(x->sp);
+        closepattern(x->rx);
+        closesearch(x->must);
+        free(x->t);
+        free(x->u);
+        free(x);
+    }
+}
+
+/* Where the target first lies wholly within the n characters at t, at
+ * column c or after, or NONE.
+ */
+static size_t
+wfirst(const SEARCH *x, const wchar_t *t, size_t n, colno c)
+{
+    size_t m = x->n;
+    wchar_t z = x->s[m - 1];
+    for (size_t j = c; m <= n && j <= n - m; j += x->skip[t[j + m - 1] & 0xff])
+        if (t[j + m - 1] == z && !wmemcmp(t + j, x->s, m - 1))
+            return j;
+    return NONE;
+}
+
+/* Where it last lies wholly within them, at column c or before, or NONE. */
+static size_t
+wlast(const SEARCH *x, const wchar_t *t, size_t n, colno c)
+{
+    size_t m = x->n;
+    if (m > n)
+        return NONE;
+    for (size_t j = c < n - m? c : n - m; ; j -= x->bskip[t[j] & 0xff]){
+        if (t[j] == x->s[0] && !wmemcmp(t + j + 1, x->s + 1, m - 1))
+            return j;
+        if (j < x->bskip[t[j] & 0xff])
+            return NONE;
+    }
+}
+
+/* Bytes are scanned for four words at a time, so many of them at once
+ * that what each is doesn't matter until a word has one that might do.
+ * A letter in either case is a byte that ORing in 0x20 makes the same.
+ */
+#define LO 0x0101010101010101ull
+#define HI (LO << 7)
+#define HASZERO(w) (((w) - LO) & ~(w) & HI)
+static bool
+anyin(const char *s, uint64_t k, uint64_t c)
+{
+    uint64_t w[4];
+    memcpy(w, s, sizeof(w));
+    for (size_t i = 0; i < 4; i++)
+        w[i] = (w[i] | c) ^ k;
+    return HASZERO(w[0]) | HASZERO(w[1]) | HASZERO(w[2]) | HASZERO(w[3]);
+}
+
+/* The first c in the n bytes at s, in either case if caseless, or NULL;
+ * a byte in one case is left to memchr.
+ */
+static const char *
+firstbyte(const char *s, unsigned char c, size_t n, bool caseless)
+{
+    if (!caseless)
+        return memchr(s, c, n);
+    size_t i = 0;
+    for (c |= 0x20; i + 4 * sizeof(uint64_t) <= n && !anyin(s + i, LO * c, LO * 0x20); )
+        i += 4 * sizeof(uint64_t);
+    for (; i < n; i++)
+        if (((unsigned char)s[i] | 0x20) == c)
+            return s + i;
+    return NULL;
+}
+
+/* The last of them, or NULL: memchr run backwards. */
+static const char *
+lastbyte(const char *s, unsigned char c, size_t n, bool caseless)
+{
+    uint64_t f = caseless? 0x20 : 0;
+    for (c |= f; n >= 4 * sizeof(uint64_t) && !anyin(s + n - 4 * sizeof(uint64_t), LO * c, LO * f); )
+        n -= 4 * sizeof(uint64_t);
+    while (n--)
+        if (((unsigned char)s[n] | f) == c)
+            return s + n;
+    return NULL;
+}
+
+/* The character at *t, before e, folded if need be, moving *t past it. */
+static wchar_t
+nextchar(const SEARCH *x, const char **t, const char *e)
+{
+    wint_t c = (unsigned char)**t;
+    if (c < 0x80)
+        return ++*t, x->up[c];
+    *t += utf8decode(*t, e - *t, &c);
+    return x->fold? foldchar(c) : (wchar_t)c;
+}
+
+/* The character before *e, after b, moving *e back onto it. It starts
+ * at the last byte before it that isn't a continuation byte, unless
+ * that decodes to something ending sooner, when it is a byte alone.
+ */
+static wchar_t
+prevchar(const SEARCH *x, const char **e, const char *b)
+{
+    const char *t = *e - 1, *a = t;
+    wint_t c = (unsigned char)*t;
+    if (c < 0x80)
+        return *e = t, x->up[c];
+    while (a > b && *e - a < 4 && (*a & 0xc0) == 0x80)
+        a--;
+    if ((*a & 0xc0) != 0x80 && a + utf8decode(a, *e - a, &c) == *e)
+        t = a;
+    else
+        c = RAWBYTE((unsigned char)*t);
+    *e = t;
+    return x->fold? foldchar(c) : (wchar_t)c;
+}
+
+/* How far the target from its i'th character on goes on matching the
+ * bytes at *t, before e, with *t moved past those it matched.
+ */
+static size_t
+ahead(const SEARCH *x, const char **t, const char *e, size_t i)
+{
+    for (const char *u = *t; i < x->n && u < e && nextchar(x, &u, e) == x->s[i]; *t = u)
+        i++;
+    return i;
+}
+
+/* Where the first k characters of the target start if they end at e,
+ * after b, or NULL.
+ */
+static const char *
+behind(const SEARCH *x, const char *b, const char *e, size_t k)
+{
+    while (k)
+        if (e == b || prevchar(x, &e, b) != x->s[--k])
+            return NULL;
+    return e;
+}
+
+/* Where the folded target first lies in the n bytes at t, or NULL. Its
+ * character to scan for is checked both ways from each place it is
+ * found. Folding can change how long characters are, so one found later
+ * might start a match sooner, as long as it is near enough.
+ */
+static const char *
+foldfirst(const SEARCH *x, const char *t, size_t n)
+{
+    const char *e = t + n, *end = e, *best = NULL, *b;
+    for (const char *q = t; q < end && (q = firstbyte(q, x->m[x->rare], end - q, x->caseless)); q++){
+        const char *a = q + 1;
+        if (ahead(x, &a, e, x->at + 1) == x->n && (b = behind(x, t, q, x->at)) && (!best || b < best)){
+            best = b;
+            end = (size_t)(e - best) > 4 * x->at? best + 4 * x->at : e;
+        }
+    }
+    return best;
+}
+
+/* Where it last lies in them, or NULL: a match found before the last
+ * place found can't start after it.
+ */
+static const char *
+foldlast(const SEARCH *x, const char *t, size_t n)
+{
+    const char *best = NULL, *q, *b;
+    for (size_t k = n; k && (q = lastbyte(t, x->m[x->rare], k, x->caseless)) && (!best || q > best); k = q - t){
+        const char *a = q + 1;
+        if (ahead(x, &a, t + n, x->at + 1) == x->n && (b = behind(x, t, q, x->at)) && (!best || b > best))
+            best = b;
+    }
+    return best;
+}
+
+/* Where the encoded target first lies in the n bytes at t, or NULL. Its
+ * rarest byte is scanned for with memchr, which goes through bytes much
+ * faster than skipping can, until it turns up too often to pay.
+ */
+static const char *
+bfirst(const SEARCH *x, const char *t, size_t n)
+{
+    const unsigned char *u = (const unsigned char *)t;
+    size_t m = x->mn, r = x->rare, j = 0;
+    if (x->fold)
+        return foldfirst(x, t, n);
+    if (m > n)
+        return NULL;
+    for (size_t miss = 0; ; j++){
+        const char *q = j <= n - m? memchr(t + j + r, x->m[r], n - m + 1 - j) : NULL;
+        if (!q)
+            return NULL;
+        if (!memcmp(u + (j = q - t - r), x->m, m))
+            return t + j;
+        if (++miss >= SCAN_MISSES && j < miss * SCAN_GAP){
+            j++;
+            break;
+        }
+    }
+    unsigned char z = x->m[m - 1];
+    for (; j <= n - m; j += x->mskip[u[j + m - 1]])
+        if (u[j + m - 1] == z && !memcmp(u + j, x->m, m - 1))
+            return t + j;
+    return NULL;
+}
+
+/* Where it last lies in them, or NULL, in the same way. */
+static const char *
+blast(const SEARCH *x, const char *t, size_t n)
+{
+    const unsigned char *u = (const unsigned char *)t;
+    size_t m = x->mn, r = x->rare, j;
+    if (x->fold)
+        return foldlast(x, t, n);
+    if (m > n)
+        return NULL;
+    j = n - m;
+    for (size_t miss = 0; ; j--){
+        const char *q = lastbyte(t + r, x->m[r], j + 1, false);
+        if (!q)
+            return NULL;
+        if (!memcmp(u + (j = q - t - r), x->m, m))
+            return t + j;
+        if (!j)
+            return NULL;
+        if (++miss >= SCAN_MISSES && n - m - j < miss * SCAN_GAP){
+            j--;
+            break;
+        }
+    }
+    for (; ; j -= x->mbskip[u[j]]){
+        if (u[j] == x->m[0] && !memcmp(u + j + 1, x->m + 1, m - 1))
+            return t + j;
+        if (j < x->mbskip[u[j]])
+            return NULL;
+    }
+}
+
+/* The bytes of l, if it is kept as bytes the target can be looked for in. */
+static const char *
+bytesof(const SEARCH *x, const LINE *l)
+{
+    return x->m? linebytes(l) : NULL;
+}
+
+/* Widen the characters of l into *t, folding them if need be, with how
+ * many there are in *n.
+ */
+static bool
+widen(SEARCH *x, const LINE *l, wchar_t **t, size_t *a, size_t *n)
+{
+    if (l->n > *a){
+        wchar_t *w = realloc(*t, l->n * sizeof(wchar_t));
+        if (!w)
+            return x->failed = true, false;
+        *t = w;
+        *a = l->n;
+    }
+    *n = linetext(l, *t);
+    for (size_t i = 0; x->fold && i < *n; i++)
+        (*t)[i] = foldchar((*t)[i]);
+    return true;
+}
+
+/* Whether the target from its i'th character on lies at the start of
+ * line l, running on over the ends of lines where it has spaces.
+ */
+static bool
+runs(SEARCH *x, SNAPSHOT *s, lineno l, size_t i)
+{
+    for (lineno e = snaplength(s); i < x->n; l++){
+        if (l >= e)
+            return false;
+        const LINE *r = snapraw(s, l);
+        const char *m;
+        size_t n;
+        if (!r)
+            return x->failed = true, false;
+        if ((m = bytesof(x, r))){
+            const char *t = m;
+            if ((i = ahead(x, &t, m + r->n, i)) == x->n)
+                return true;
+            if (t != m + r->n || x->s[i] != L' ')
+                return false;
+            i++;
+            continue;
+        }
+        if (!widen(x, r, &x->u, &x->ua, &n))
+            return false;
+        if (x->n - i <= n)
+            return !wmemcmp(x->u, x->s + i, x->n - i);
+        if (wmemcmp(x->u, x->s + i, n) || x->s[i + n] != L' ')
+            return false;
+        i += n + 1;
+    }
+    return true;
+}
+
+/* Where the target lies in line l, which is r: the first place at column
+ * c or after it, or if back the last at c or before it, or NONE. A line
+ * to be searched whole is searched as bytes if it can be. Places where
+ * it runs over the end of the line come after the rest.
+ */
+static colno
+within(SEARCH *x, SNAPSHOT *s, lineno l, const LINE *r, colno c, bool back)
+{
+    const char *m = (back? c == NONE : !c)? bytesof(x, r) : NULL;
+    size_t n = r->n, at;
+    if (x->rx){
+        if (!widen(x, r, &x->t, &x->ta, &n))
+            return NONE;
+        int rc = back? lastmatch(x->rx, x->t, n, c, &at, &x->len) : firstmatch(x->rx, x->t, n, c, &at, &x->len);
+        if (rc < 0)
+            x->failed = true;
+        return rc > 0? at : NONE;
+    }
+    if (m){
+        const char *h = back? NULL : bfirst(x, m, n);
+        if (h)
+            return countchars(m, h - m);
+        for (size_t i = 0; i < x->nsp; i++){
+            size_t j = back? i : x->nsp - 1 - i;
+            if ((h = behind(x, m, m + n, x->sp[j])) && runs(x, s, l + 1, x->sp[j] + 1))
+                return countchars(m, h - m);
+        }
+        h = back? blast(x, m, n) : NULL;
+        return h? countchars(m, h - m) : NONE;
+    }
+
+    if (!widen(x, r, &x->t, &x->ta, &n))
+        return NONE;
+    colno j = back? NONE : wfirst(x, x->t, n, c);
+    if (j != NONE)
+        return j;
+    for (size_t i = 0; i < x->nsp; i++){
+        size_t k = x->sp[back? i : x->nsp - 1 - i];
+        if (k <= n && (back? n - k <= c : n - k >= c)
+        &&  !wmemcmp(x->t + n - k, x->s, k) && runs(x, s, l + 1, k + 1))
+            return n - k;
+    }
+    return back? wlast(x, x->t, n, c) : NONE;
+}
+
+/* A target with no spaces can't run over the end of a line, so lines that
+ * follow one another in their file are searched together.
+ */
+static bool
+together(const SEARCH *x, lineno l, POS p, colno whole)
+{
+    return !x->nsp && !x->rx && (l != p.l || p.c == whole);
+}
+
+static bool
+forward(SEARCH *x, SNAPSHOT *s, POS p, lineno stop, POS *at)
+{
+    for (lineno l = p.l, e = snaplength(s); l < e && l <= stop && !x->failed; ){
+        lineno first;
+        size_t k;
+        const LINE *r = snapleaf(s, l, &first, &k);
+        if (!r)
+            return x->failed = true, false;
+
+        size_t i = l - first, j = i;
+        const char *m = together(x, l, p, 0)? bytesof(x, r + i) : NULL, *z, *q;
+        if (m){
+            for (z = m + r[i].n; j + 1 < k && first + j < stop && (q = bytesof(x, r + j + 1)) == z + 1 && *z == '\n'; j++)
+                z = q + r[j + 1].n;
+
+            const char *h = bfirst(x, m, z - m);
+            if (h){
+                while (i < j && h >= linebytes(r + i + 1))
+                    i++;
+                *at = pos(first + i, countchars(linebytes(r + i), h - linebytes(r + i)));
+                return true;
+            }
+            l = first + j + 1;
+            continue;
+        }
+
+        colno c = within(x, s, l, r + i, l == p.l? p.c : 0, false);
+        if (c != NONE)
+            return *at = pos(l, c), true;
+        l++;
+    }
+    return false;
+}
+
+static bool
+backward(SEARCH *x, SNAPSHOT *s, POS p, lineno stop, POS *at)
+{
+    for (lineno l = p.l; !x->failed; ){
+        lineno first;
+        size_t k;
+        const LINE *r = snapleaf(s, l, &first, &k);
+        if (!r)
+            return x->failed = true, false;
+
+        size_t i = l - first, j = i;
+        const char *m = together(x, l, p, NONE)? bytesof(x, r + i) : NULL, *a = m, *z, *q;
+        if (m){
+            for (z = m + r[i].n; j && first + j > stop && (q = bytesof(x, r + j - 1)) && q + r[j - 1].n + 1 == a && q[r[j - 1].n] == '\n'; j--)
+                a = q;
+
+            const char *h = blast(x, a, z - a);
+            if (h){
+                while (i > j && h < linebytes(r + i))
+                    i--;
+                *at = pos(first + i, countchars(linebytes(r + i), h - linebytes(r + i)));
+                return true;
+            }
+            if ((l = first + j) <= stop)
+                return false;
+            l--;
+            continue;
+        }
+
+        colno c = within(x, s, l, r + i, l == p.l? p.c : NONE, true);
+        if (c != NONE)
+            return *at = pos(l, c), true;
+        if (l <= stop)
+            return false;
+        l--;
+    }
+    return false;
+}
+
+/* Look for an expression only in lines that have its string in them. A
+ * match before p may have it after p, so p's own line is looked at first
+ * going backwards.
+ */
+static bool
+narrowed(SEARCH *x, SNAPSHOT *s, POS p, bool back, lineno stop, POS *at)
+{
+    lineno l = p.l;
+    colno c = p.c;
+    if (back){
+        const LINE *r = snapraw(s, l);
+        if (!r)
+            return x->failed = true, false;
+        if ((c = within(x, s, l, r, c, true)) != NONE)
+            return *at = pos(l, c), true;
+        if (x->failed || l-- <= stop)
+            return false;
+    }
+    for (lineno e = snaplength(s); ; ){
+        POS h;
+        size_t n;
+        int rc = search(x->must, s, pos(l, c), back, stop, &h, &n);
+        const LINE *r = rc > 0? snapraw(s, h.l) : NULL;
+        if (rc <= 0 || !r)
+            return x->failed = rc != 0, false;
+        colno k = within(x, s, h.l, r, h.l == l? c : back? NONE : 0, back);
+        if (k != NONE)
+            return *at = pos(h.l, k), true;
+        if (x->failed || (back? h.l <= stop : h.l + 1 >= e || h.l >= stop))
+            return false;
+        l = back? h.l - 1 : h.l + 1;
+        c = back? NONE : 0;
+    }
+}
+
+/* Find the target in s: the first place at p or after it, or if back the
+ * last place at p or before it, where a column of NONE is past the end
+ * of the line, starting no further on than line stop, or if back no
+ * further back. This returns 1 with the place in *at and how many
+ * characters were found there in *len, 0 if there isn't one and -1 if
+ * memory ran out. Only s is touched, so it can be done off the editing
+ * thread.
+ */
+int
+search(SEARCH *x, SNAPSHOT *s, POS p, bool back, lineno stop, POS *at, size_t *len)
+{
+    x->failed = false;
+    bool found = p.l < snaplength(s) && (back? p.l >= stop : p.l <= stop)
+              && (x->must? narrowed(x, s, p, back, stop, at) : back? backward(x, s, p, stop, at) : forward(x, s, p, stop, at));
+    *len = x->len;
+    return x->failed? -1 : found;
+}
+
+/* How many places in the n bytes at t the target starts at. */
+static size_t
+bhits(const SEARCH *x, const char *t, size_t n)
+{
+    size_t k = 0;
+    wint_t c;
+    for (const char *h = t, *e = t + n; h < e && (h = bfirst(x, h, e - h)); k++)
+        h += utf8decode(h, e - h, &c);
+    return k;
+}
+
+/* How many places in line l, which is r, the target starts at before
+ * column end, those where it runs over the end of the line among them.
+ */
+static size_t
+hits(SEARCH *x, SNAPSHOT *s, lineno l, const LINE *r, colno end)
+{
+    const char *m = end == NONE? bytesof(x, r) : NULL;
+    size_t n = r->n, k = 0;
+    if (x->rx){
+        if (widen(x, r, &x->t, &x->ta, &n) && !matchstarts(x->rx, x->t, n, end, &k))
+            x->failed = true;
+        return k;
+    }
+    if (m){
+        k = bhits(x, m, n);
+        for (size_t i = 0; i < x->nsp; i++)
+            if (behind(x, m, m + n, x->sp[i]) && runs(x, s, l + 1, x->sp[i] + 1))
+                k++;
+        return k;
+    }
+
+    if (!widen(x, r, &x->t, &x->ta, &n))
+        return 0;
+    for (colno c = 0, j; (j = wfirst(x, x->t, n, c)) != NONE && j < end; c = j + 1)
+        k++;
+    for (size_t i = 0; i < x->nsp; i++){
+        size_t j = x->sp[i];
+        if (j <= n && n - j < end && !wmemcmp(x->t + n - j, x->s, j) && runs(x, s, l + 1, j + 1))
+            k++;
+    }
+    return k;
+}
+
+/* Count the places in s from the start of line first up to end that the
+ * target starts at into *n, which are the places a search would stop at
+ * going on each time from just past the last. Between lines stop, if it
+ * is given, is asked whether to give up. This returns 1 once they are
+ * counted, 0 if it gave up and -1 if memory ran out.
+ */
+int
+tally(SEARCH *x, SNAPSHOT *s, lineno first, POS end, bool (*stop)(void *), void *p, size_t *n)
+{
+    lineno last = end.c? end.l : end.l - 1, e = snaplength(s);
+    x->failed = false;
+    *n = 0;
+    for (lineno l = first; (end.l || end.c) && l <= last && l < e && !x->failed; ){
+        POS h;
+        size_t k, len;
+        if (stop && stop(p))
+            return 0;
+        if (x->must){
+            int rc = search(x->must, s, pos(l, 0), false, last, &h, &len);
+            if (rc <= 0)
+                return rc < 0? -1 : 1;
+            l = h.l;
+        }
+
+        lineno f;
+        const LINE *r = snapleaf(s, l, &f, &k);
+        if (!r)
+            return -1;
+        size_t i = l - f, j = i;
+        const char *m = l < end.l && together(x, l, pos(first, 0), 0)? bytesof(x, r + i) : NULL, *z, *q;
+        if (m){
+            for (z = m + r[i].n; j + 1 < k && f + j + 1 < end.l && (q = bytesof(x, r + j + 1)) == z + 1 && *z == '\n'; j++)
+                z = q + r[j + 1].n;
+            *n += bhits(x, m, z - m);
+            l = f + j + 1;
+            continue;
+        }
+        *n += hits(x, s, l, r + i, l == end.l? end.c : NONE);
+        l++;
+    }
+    return x->failed? -1 : 1;
+}
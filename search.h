@@ -0,0 +1,14 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stdbool.h>
+#include <wchar.h>
+
+#include "structs.h"
+
+SEARCH *opensearch(const wchar_t *s, size_t n, bool fold, bool re, const char **err);
+void closesearch(SEARCH *x);
+int search(SEARCH *x, SNAPSHOT *s, POS p, bool back, lineno stop, POS *at, size_t *len);
+int tally(SEARCH *x, SNAPSHOT *s, lineno first, POS end, bool (*stop)(void *), void *p, size_t *n);
+
+#endif
@@ -1,15 +1,25 @@
 #ifndef STRUCTS_H
 #define STRUCTS_H
 
+typedef struct ARENA ARENA;
 typedef struct ARG ARG;
 typedef struct BUFFER BUFFER;
 typedef struct CMD CMD;
+typedef struct COUNT COUNT;
 typedef struct EDITOR EDITOR;
 typedef struct JOURNAL JOURNAL;
 typedef struct KEYSTROKE KEYSTROKE;
 typedef struct LINE LINE;
 typedef struct MODE MODE;
+typedef struct NODE NODE;
+typedef struct PATTERN PATTERN;
 typedef struct POS POS;
+typedef struct READER READER;
+typedef struct SAVE SAVE;
+typedef struct SEARCH SEARCH;
+typedef struct FOLLOW FOLLOW;
+typedef struct SNAPSHOT SNAPSHOT;
+typedef struct SOURCE SOURCE;
 typedef struct TAG TAG;
 typedef struct VIEW VIEW;
 
@@ -1,4 +1,3 @@
-#include <errno.h>
 #include <ctype.h>
 #include <locale.h>
 #include <stdio.h>
@@ -57,13 +56,7 @@ initializescreen(int i)
 static void
 loadfile(const char *fn)
 {
-    wchar_t *s = stows(fn, strlen(fn));
-    if (!s)
-        quit("Out of memory\n", EXIT_FAILURE);
-    ARG a = {.t = ARG_STRING, .s1 = s, .n1 = wcslen(s)};
-    errno = 0;
-    cmd_if(editor, &editor->docview, &a);
-    free(s);
+    startload(editor, fn);
 }
 
 static void
@@ -4,6 +4,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <langinfo.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -32,50 +37,39 @@ ellipsize(const char *s, size_t l, bool right)
    return o;
 }
 
+/* Decode the n bytes at s, which needn't be valid, into a new string. */
 wchar_t *
 stows(const char *s, size_t n)
 {
-    char *mbs = calloc(n + 1, sizeof(char));
-    if (!mbs)
-        return NULL;
-    strncpy(mbs, s, n);
-
-    size_t wcn = mbstowcs(NULL, mbs, 0);
-    wchar_t *wcs = calloc(wcn + 1, sizeof(wchar_t));
+    wchar_t *wcs = calloc(n + 1, sizeof(wchar_t));
     if (!wcs)
-        return free(mbs), NULL;
-
-    size_t wcr = mbstowcs(wcs, mbs, wcn);
-    if (wcr == (size_t)-1)
-        return free(mbs), free(wcs), NULL;
-
-    free(mbs);
+        return NULL;
+    wcs[decodebytes(wcs, s, n)] = 0;
     return wcs;
 }
 
+/* Encode the n characters at s into a new string, undoing stows. */
 char *
 wstos(const wchar_t *s, size_t n)
 {
-    wchar_t *wcs = calloc(n + 1, sizeof(wchar_t));
-    if (!wcs)
-        return NULL;
-    wcsncpy(wcs, s, n);
-
-    size_t mbn = wcstombs(NULL, wcs, 0);
-    char *mbs = calloc(mbn + 1, sizeof(char));
+    char *mbs = calloc(n * MB_CUR_MAX + 1, sizeof(char)), *o = mbs;
     if (!mbs)
-        return free(wcs), NULL;
-
-    size_t mbr = wcstombs(mbs, wcs, mbn);
-    if (mbr == (size_t)-1)
-        return free(mbs), free(wcs), NULL;
+        return NULL;
 
-    free(wcs);
+    mbstate_t ms;
+    memset(&ms, 0, sizeof(ms));
+    for (size_t i = 0; i < n; i++)
+        o += encodechar(s[i], o, &ms);
+    *o = 0;
     return mbs;
 }
 
+/* Call cb with each line of fn, without its newline, as it is read in
+ * large blocks. A line is only valid for the duration of the call.
+ */
+#define READ_BLOCK (1 << 20)
 bool
-readfile(const char *fn, bool (*cb)(const wchar_t *, size_t, void *), void *p)
+readfile(const char *fn, bool (*cb)(const char *, size_t, void *), void *p)
 {
     struct stat s = {0};
     if (stat(fn, &s) != 0)
@@ -83,29 +77,298 @@ readfile(const char *fn, bool (*cb)(const wchar_t *, size_t, void *), void *p)
     if ((s.st_mode & S_IFMT) == S_IFDIR)
        return (errno = EISDIR), false;
 
-    FILE *f = fopen(fn, "r");
-    if (!f)
+    int fd = open(fn, O_RDONLY);
+    if (fd < 0)
         return false;
 
-    char *l = NULL;
-    size_t ln = 0;
-    ssize_t n = 0;
-    bool rc = true;
-    while ((n = getline(&l, &ln, f)) != -1 && rc){
-        if (n && l[n - 1] == '\n')
-            n--;
-        if (n){
-            wchar_t *c = stows(l, n);
-            rc = c && cb(c, wcslen(c), p);
-            free(c);
-        } else
-            rc = cb(L"", 0, p);
+    size_t a = READ_BLOCK, n = 0;
+    char *b = malloc(a);
+    bool rc = b != NULL, eof = false;
+    while (rc && !eof){
+        if (a - n < READ_BLOCK / 2){
+            char *t = realloc(b, a * 2);
+            if (!(rc = t != NULL))
+                break;
+            b = t;
+            a *= 2;
+        }
+
+        ssize_t r = read(fd, b + n, a - n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (!(rc = r >= 0))
+            break;
+        eof = r == 0;
+        n += r;
+
+        char *l = b, *e = b + n, *nl;
+        while (rc && (nl = memchr(l, '\n', e - l)) != NULL){
+            rc = cb(l, nl - l, p);
+            l = nl + 1;
+        }
+        if (rc && eof && l < e)
+            rc = cb(l, e - l, p);
+        n = e - l;
+        memmove(b, l, n);
     }
-    free(l);
-    fclose(f);
+    int err = errno;
+    free(b);
+    close(fd);
+    errno = err;
     return rc;
 }
 
+/* The length of the run of ASCII at the start of s, four words and then
+ * one word at a time.
+ */
+size_t
+asciispan(const char *s, size_t n)
+{
+    size_t i = 0;
+    for (uint64_t w[4]; i + sizeof(w) <= n; i += sizeof(w)){
+        memcpy(w, s + i, sizeof(w));
+        if ((w[0] | w[1] | w[2] | w[3]) & 0x8080808080808080ull)
+            break;
+    }
+    for (uint64_t w; i + sizeof(w) <= n; i += sizeof(w)){
+        memcpy(&w, s + i, sizeof(w));
+        if (w & 0x8080808080808080ull)
+            break;
+    }
+    while (i < n && !(s[i] & 0x80))
+        i++;
+    return i;
+}
+
+/* Decode one character from the n > 0 bytes at s into *c, returning how
+ * many bytes it took. A byte that does not start a well-formed sequence
+ * decodes by itself as RAWBYTE(byte), so that it can be written back.
+ */
+size_t
+utf8decode(const char *s, size_t n, wint_t *c)
+{
+    const unsigned char *u = (const unsigned char *)s;
+    static const wint_t min[] = {0, 0, 0x80, 0x800, 0x10000};
+    size_t k = u[0] < 0x80? 1 : u[0] < 0xc2? 0 : u[0] < 0xe0? 2 : u[0] < 0xf0? 3 : u[0] < 0xf5? 4 : 0;
+    if (k == 1)
+        return *c = u[0], 1;
+    if (!k || k > n)
+        return *c = RAWBYTE(u[0]), 1;
+
+    wint_t x = u[0] & (0x7f >> k);
+    for (size_t i = 1; i < k; i++){
+        if ((u[i] & 0xc0) != 0x80)
+            return *c = RAWBYTE(u[0]), 1;
+        x = x << 6 | (u[i] & 0x3f);
+    }
+    if (x < min[k] || x > 0x10ffff || (x >= 0xd800 && x < 0xe000))
+        return *c = RAWBYTE(u[0]), 1;
+    return *c = x, k;
+}
+
+/* Encode c at s, returning how many bytes it took; there must be room
+ * for four. A RAWBYTE becomes its byte again, and anything else that
+ * isn't a Unicode scalar value becomes U+FFFD.
+ */
+size_t
+utf8encode(wint_t c, char *s)
+{
+    unsigned char *u = (unsigned char *)s;
+    if (ISRAWBYTE(c))
+        return u[0] = c & 0xff, 1;
+    if (c > 0x10ffff || (c >= 0xd800 && c < 0xe000))
+        c = 0xfffd;
+    if (c < 0x80)
+        return u[0] = c, 1;
+    if (c < 0x800)
+        return u[0] = 0xc0 | c >> 6, u[1] = 0x80 | (c & 0x3f), 2;
+    if (c < 0x10000){
+        u[0] = 0xe0 | c >> 12;
+        u[1] = 0x80 | (c >> 6 & 0x3f);
+        u[2] = 0x80 | (c & 0x3f);
+        return 3;
+    }
+    u[0] = 0xf0 | c >> 18;
+    u[1] = 0x80 | (c >> 12 & 0x3f);
+    u[2] = 0x80 | (c >> 6 & 0x3f);
+    u[3] = 0x80 | (c & 0x3f);
+    return 4;
+}
+
+/* Decode the n bytes at m into the characters at s, of which there must
+ * be room for n, returning how many there were. Runs of ASCII are copied
+ * without looking at them a byte at a time, and bytes that don't decode
+ * in the locale's encoding become RAWBYTEs, as in utf8decode.
+ */
+size_t
+decodebytes(wchar_t *s, const char *m, size_t n)
+{
+    size_t k = 0;
+    if (isutf8()){
+        for (size_t i = 0; i < n; ){
+            size_t a = asciispan(m + i, n - i);
+            for (size_t j = 0; j < a; j++)
+                s[k++] = (unsigned char)m[i + j];
+            if ((i += a) < n){
+                wint_t c;
+                i += utf8decode(m + i, n - i, &c);
+                s[k++] = c;
+            }
+        }
+        return k;
+    }
+
+    mbstate_t ms;
+    memset(&ms, 0, sizeof(ms));
+    for (size_t i = 0; i < n; k++){
+        size_t r = mbrtowc(s + k, m + i, n - i, &ms);
+        if (r == (size_t)-1 || r == (size_t)-2){
+            s[k] = (unsigned char)m[i] < 0x80? 0xfffd : RAWBYTE((unsigned char)m[i]);
+            memset(&ms, 0, sizeof(ms));
+            r = 1;
+        }
+        i += r? r : 1;
+    }
+    return k;
+}
+
+/* How many characters decodebytes would make of the n bytes at m. */
+size_t
+countchars(const char *m, size_t n)
+{
+    size_t k = 0;
+    if (isutf8()){
+        for (size_t i = 0; i < n; ){
+            size_t a = asciispan(m + i, n - i);
+            k += a;
+            if ((i += a) < n){
+                wint_t c;
+                i += utf8decode(m + i, n - i, &c);
+                k++;
+            }
+        }
+        return k;
+    }
+
+    mbstate_t ms;
+    memset(&ms, 0, sizeof(ms));
+    for (size_t i = 0; i < n; k++){
+        size_t r = mbrtowc(NULL, m + i, n - i, &ms);
+        if (r == (size_t)-1 || r == (size_t)-2){
+            memset(&ms, 0, sizeof(ms));
+            r = 1;
+        }
+        i += r? r : 1;
+    }
+    return k;
+}
+
+/* Encode c at s in the locale's encoding, returning how many bytes it
+ * took; there must be room for MB_CUR_MAX. What can't be encoded is
+ * written as '?'.
+ */
+size_t
+encodechar(wint_t c, char *s, mbstate_t *ms)
+{
+    if (c < 0x80)
+        return *s = c, 1;
+    if (isutf8())
+        return utf8encode(c, s);
+    if (ISRAWBYTE(c))
+        return *s = c & 0xff, 1;
+    size_t r = wcrtomb(s, c, ms);
+    if (r == (size_t)-1){
+        memset(ms, 0, sizeof(*ms));
+        return *s = '?', 1;
+    }
+    return r;
+}
+
+/* Whether the locale's encoding is UTF-8; the locale is set only once. */
+bool
+isutf8(void)
+{
+    static int u = -1;
+    if (u < 0){
+        const char *c = nl_langinfo(CODESET);
+        u = strcmp(c, "UTF-8") == 0 || strcmp(c, "utf8") == 0;
+    }
+    return u;
+}
+
+/* Something else can cut a mapped file short, and reading what was past
+ * its new end then raises SIGBUS. Rather than have the editor die with
+ * unsaved changes in it, the page read is replaced by one of zero bytes
+ * and what lay there reads as NULs; mapcut says whether that happened.
+ */
+static int zerofd = -1;
+static long pagesize;
+static volatile sig_atomic_t cut;
+
+static void
+onbus(int sig, siginfo_t *si, void *ctx)
+{
+    (void)ctx;
+    uintptr_t a = (uintptr_t)si->si_addr & ~(uintptr_t)(pagesize - 1);
+    if (si->si_code != BUS_ADRERR
+    ||  mmap((void *)a, pagesize, PROT_READ, MAP_PRIVATE | MAP_FIXED, zerofd, 0) == MAP_FAILED){
+        signal(sig, SIG_DFL); /* so that it is raised again, and kills */
+        return;
+    }
+    cut = 1;
+}
+
+static bool
+guardmaps(void)
+{
+    if (zerofd >= 0)
+        return true;
+    struct sigaction sa = {0};
+    sa.sa_sigaction = onbus;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    pagesize = sysconf(_SC_PAGESIZE);
+    if ((zerofd = open("/dev/zero", O_RDONLY)) < 0)
+        return false;
+    if (sigaction(SIGBUS, &sa, NULL) != 0){
+        close(zerofd);
+        zerofd = -1;
+        return false;
+    }
+    return true;
+}
+
+/* Whether a mapped file has been found cut short since this was last asked. */
+bool
+mapcut(void)
+{
+    bool r = cut;
+    cut = 0;
+    return r;
+}
+
+char *
+mapfile(const char *fn, size_t *n, struct stat *s)
+{
+    if (!guardmaps())
+        return NULL;
+    /* opening a FIFO just to find it can't be mapped would eat its data */
+    if (stat(fn, s) != 0 || (s->st_mode & S_IFMT) != S_IFREG)
+        return NULL;
+    int fd = open(fn, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, s) != 0 || (s->st_mode & S_IFMT) != S_IFREG || !s->st_size)
+        return close(fd), NULL;
+
+    void *m = mmap(NULL, s->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED)
+        return NULL;
+    *n = s->st_size;
+    return m;
+}
+
 wchar_t *
 dupstr(const wchar_t *s, size_t n)
 {
@@ -3,15 +3,31 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <sys/stat.h>
 #include <wchar.h>
 
+/* Bytes that don't decode are kept as the low surrogates U+DC80 to U+DCFF,
+ * which no well-formed text can contain, and are written back as they were.
+ */
+#define RAWBYTE(b)   ((wint_t)(0xdc00 | (b)))
+#define ISRAWBYTE(c) ((c) >= 0xdc80 && (c) <= 0xdcff)
+
 char *ellipsize(const char *s, size_t l, bool right);
 wchar_t *dupstr(const wchar_t *s, size_t n);
 wchar_t *stows(const char *s, size_t n);
 char *wstos(const wchar_t *s, size_t n);
 const char *trimleft(const char *s);
+char *mapfile(const char *fn, size_t *n, struct stat *s);
+bool mapcut(void);
 bool readfile(const char *fn,
-              bool (*cb)(const wchar_t *, size_t, void *),
+              bool (*cb)(const char *, size_t, void *),
               void *p);
+size_t asciispan(const char *s, size_t n);
+size_t utf8decode(const char *s, size_t n, wint_t *c);
+size_t utf8encode(wint_t c, char *s);
+size_t decodebytes(wchar_t *s, const char *m, size_t n);
+size_t countchars(const char *m, size_t n);
+size_t encodechar(wint_t c, char *s, mbstate_t *ms);
+bool isutf8(void);
 
 #endif